@@ -14,10 +14,20 @@ $CC $CFLAGS -o out/util.o -c src/util.c
 $CC $CFLAGS -o out/build.o -c src/build.c
 $CC $CFLAGS -o out/filepath.o -c src/filepath.c
 $CC $CFLAGS -o out/sha1.o -c src/sha1.c
+$CC $CFLAGS -o out/blake3.o -c src/blake3.c
+$CC $CFLAGS -o out/hash.o -c src/hash.c
 $CC $CFLAGS -o out/DSV.o -c src/DSV.c
+$CC $CFLAGS -o out/jobs.o -c src/jobs.c
+$CC $CFLAGS -o out/depdb.o -c src/depdb.c
+$CC $CFLAGS -o out/gitindex.o -c src/gitindex.c
+$CC $CFLAGS -o out/statcache.o -c src/statcache.c
+$CC $CFLAGS -o out/pathtab.o -c src/pathtab.c
+$CC $CFLAGS -o out/dircache.o -c src/dircache.c
+$CC $CFLAGS -o out/depfile.o -c src/depfile.c
 $CC $CFLAGS -o out/redo.o -c src/redo.c
 $CC -o out/redo out/redo.o out/util.o out/build.o out/filepath.o out/sha1.o \
-       out/DSV.o $LDFLAGS
+       out/blake3.o out/hash.o out/DSV.o out/jobs.o out/depdb.o out/gitindex.o \
+       out/statcache.o out/pathtab.o out/dircache.o out/depfile.o $LDFLAGS
 )
 
 ln -sf redo out/redo-ifchange
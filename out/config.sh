@@ -4,8 +4,8 @@ else
 	PREF="gcc"
 fi
 CC=${CC-$PREF}
-CFLAGS="-g -Wall -Wextra -std=c99 -pedantic -Wno-gnu-statement-expression $CFLAGS"
-LDFLAGS="$LDFLAGS"
+CFLAGS="-g -Wall -Wextra -std=c99 -pedantic -Wno-gnu-statement-expression -pthread $CFLAGS"
+LDFLAGS="-pthread $LDFLAGS"
 
 if [ ! -n "$BOOTSTRAP_BUILD" ]; then
 	if [ -f "../config.local" ]; then
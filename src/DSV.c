@@ -6,6 +6,7 @@
  * of the MIT license.  See the LICENSE file for details.
  */
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -41,38 +42,31 @@ size_t encode_string(char *dest, const char *src) {
 	return dest - start;
 }
 
-static void decode_string(char *dest, const char *src, size_t len) {
-	for (size_t i = 0; i < len-1; ++i) {
-		char c = src[i];
-		if (c != '\\') {
-			*(dest++) = c;
-			continue;
-		}
-
-		/* check if we are at the end of the string */
-		if (*src == '\0') {
-			debug("DSV: ignored extra '\\' at end of string\n");
-			break;
-		}
+/* Unescape the field starting at src in place, up to the next unescaped ':' or
+   eol. Returns a pointer to the character that terminated the field. */
+static char *unescape_field(char *src, const char *eol) {
+	char *dest = src;
 
-		switch (c = *(src++)) {
-		case 'n':
-			*(dest++) = '\n';
-			break;
-		default:
-			*(dest++) = c;
+	while (src < eol && *src != ':') {
+		if (*src == '\\' && src+1 < eol) {
+			++src;
+			*(dest++) = (*src == 'n') ? '\n' : *src;
+			++src;
+		} else {
+			*(dest++) = *(src++);
 		}
 	}
 
 	*dest = '\0';
+	return src;
 }
 
 void dsv_init(struct dsv_ctx *ctx, size_t fields_count) {
 	ctx->fields_count = fields_count;
 	ctx->fields = xmalloc(fields_count * sizeof(char*));
 	ctx->offset = 0;
-	ctx->bufsize = 1024;
-	ctx->buf = xmalloc(ctx->bufsize);
+	ctx->bufsize = 0; /* allocated by dsv_parse_file() once needed */
+	ctx->buf = NULL;
 	ctx->buflen = 0;
 }
 
@@ -81,73 +75,95 @@ void dsv_free(struct dsv_ctx *ctx) {
 	free(ctx->buf);
 }
 
-int dsv_parse_next_line(struct dsv_ctx *context, const char *src, size_t len) {
-	char *newline = memchr(src, '\n', len);
+/* Parse the next line of buf in place: each field is null-terminated and
+   unescaped inside of buf and context->fields points to them. Nothing is
+   allocated, the fields are valid as long as buf is. Returns 0 on success. */
+int dsv_parse_in_place(struct dsv_ctx *context, char *buf, size_t len) {
+	char *newline = memchr(buf, '\n', len);
 
 	if (!newline) {
 		context->status = E_NO_NEWLINE_FOUND;
 		return 1;
 	}
 
-	context->processed = newline-src+1;
+	context->processed = newline-buf+1;
 	if (context->processed == 1) {
 		debug("DSV: empty newline detected\n");
 		context->status = E_EMPTY_NEWLINE;
 		return 1;
 	}
 
-	char *start = (char*) src;
+	/* fields without escape sequences need no decoding at all */
+	bool escaped = memchr(buf, '\\', newline-buf);
+	char *start = buf, *end;
 	size_t i = 0;
-	ptrdiff_t size;
-
-	while (1) {
-		char *colon = memchr(start, ':', newline-start+1);
-		if (colon)
-			size = colon-start;
-		else
-			size = newline-start;
-
-		if (size <= 0) {
-			if (!size) {
-				debug("DSV: empty field detected\n");
-				context->status = E_EMPTY_FIELD;
-				goto error;
-			}
 
-			break;
+	while (start <= newline) {
+		if (escaped) {
+			end = unescape_field(start, newline);
+		} else {
+			end = memchr(start, ':', newline-start);
+			if (!end)
+				end = newline;
+		}
+
+		if (end == start) {
+			debug("DSV: empty field detected\n");
+			context->status = E_EMPTY_FIELD;
+			return 1;
 		}
 
 		if (i >= context->fields_count) {
 			debug("DSV: too many fields\n");
 			context->status = E_TOO_MANY_FIELDS;
-			goto error;
+			return 1;
 		}
 
-		char *buf = xmalloc(size+1);
-		decode_string(buf, start, size+1);
-		context->fields[i] = buf;
-
-		start += size + 1;
-		++i;
+		*end = '\0';
+		context->fields[i++] = start;
+		start = end + 1;
 	}
 
-	if (i+1 < context->fields_count) {
-		debug("DSV: too few fields (%zu)\n", i+1);
+	if (i < context->fields_count) {
+		debug("DSV: too few fields (%zu)\n", i);
 		context->status = E_TOO_FEW_FIELDS;
-		goto error;
+		return 1;
 	}
 
 	context->status = E_SUCCESS;
 	return 0;
+}
 
-error:
-	for (size_t j = 0; j < i; ++j)
-		free(context->fields[j]);
+/* Like dsv_parse_in_place(), but leaves src untouched and returns a heap
+   allocated copy of every field, which has to be freed by the caller. */
+int dsv_parse_next_line(struct dsv_ctx *context, const char *src, size_t len) {
+	if (!len) {
+		context->status = E_NO_NEWLINE_FOUND;
+		return 1;
+	}
 
-	return 1;
+	char *newline = memchr(src, '\n', len);
+	if (newline)
+		len = newline-src+1;
+
+	char *line = xmalloc(len);
+	memcpy(line, src, len);
+
+	int ret = dsv_parse_in_place(context, line, len);
+	if (!ret)
+		for (size_t i = 0; i < context->fields_count; ++i)
+			context->fields[i] = xstrdup(context->fields[i]);
+
+	free(line);
+	return ret;
 }
 
 int dsv_parse_file(struct dsv_ctx *ctx, FILE *fp) {
+	if (!ctx->buf) {
+		ctx->bufsize = 1024;
+		ctx->buf = xmalloc(ctx->bufsize);
+	}
+
 	size_t read = ctx->buflen;
 	if (!read) {
 		read = fread(ctx->buf, 1, ctx->bufsize, fp);
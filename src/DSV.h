@@ -38,6 +38,7 @@ struct dsv_ctx {
 size_t encode_string(char *dest, const char *src);
 void dsv_init(struct dsv_ctx *context, size_t fields_count);
 void dsv_free(struct dsv_ctx *context);
+int dsv_parse_in_place(struct dsv_ctx *context, char *buf, size_t len);
 int dsv_parse_next_line(struct dsv_ctx *context, const char *src, size_t len);
 int dsv_parse_file(struct dsv_ctx *ctx, FILE *fp);
 
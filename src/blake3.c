@@ -0,0 +1,400 @@
+/* blake3.c
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+/* BLAKE3 with a 32 byte output, following the specification at
+   https://github.com/BLAKE3-team/BLAKE3-specs. Whole chunks are hashed four at
+   a time using the vector extensions of GCC and clang, which are lowered to
+   SSE2, NEON or whatever the target provides, and to scalar code otherwise.
+   Large inputs can additionally be split into subtrees which are hashed by
+   several threads, see BLAKE3_UpdateParallel(). */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "blake3.h"
+
+#define CHUNK_START (1 << 0)
+#define CHUNK_END   (1 << 1)
+#define PARENT      (1 << 2)
+#define ROOT        (1 << 3)
+
+#define LANES 4
+
+/* size of the subtrees hashed by the threads of BLAKE3_UpdateParallel() */
+#define SUBTREE_CHUNKS 1024
+#define SUBTREE_LEN ((size_t) SUBTREE_CHUNKS * BLAKE3_CHUNK_LEN)
+
+typedef uint32_t vec __attribute__((vector_size(LANES * sizeof(uint32_t))));
+
+static const uint32_t IV[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+/* the message word permutation, applied once per round */
+static const uint8_t SCHEDULE[7][16] = {
+	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+	{2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+	{3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+	{10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+	{12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+	{9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+	{11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+/* the output of a chunk or parent node, before its final compression */
+typedef struct {
+	uint32_t cv[8];
+	uint8_t block[BLAKE3_BLOCK_LEN];
+	uint8_t block_len;
+	uint64_t counter;
+	uint8_t flags;
+} output;
+
+/* works for both uint32_t and vec */
+#define ROTR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+#define G(v, a, b, c, d, x, y) do { \
+	v[a] = v[a] + v[b] + (x); \
+	v[d] = ROTR(v[d] ^ v[a], 16); \
+	v[c] = v[c] + v[d]; \
+	v[b] = ROTR(v[b] ^ v[c], 12); \
+	v[a] = v[a] + v[b] + (y); \
+	v[d] = ROTR(v[d] ^ v[a], 8); \
+	v[c] = v[c] + v[d]; \
+	v[b] = ROTR(v[b] ^ v[c], 7); \
+} while (0)
+
+#define ROUND(v, m, r) do { \
+	const uint8_t *s = SCHEDULE[r]; \
+	G(v, 0, 4,  8, 12, m[s[0]],  m[s[1]]); \
+	G(v, 1, 5,  9, 13, m[s[2]],  m[s[3]]); \
+	G(v, 2, 6, 10, 14, m[s[4]],  m[s[5]]); \
+	G(v, 3, 7, 11, 15, m[s[6]],  m[s[7]]); \
+	G(v, 0, 5, 10, 15, m[s[8]],  m[s[9]]); \
+	G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]); \
+	G(v, 2, 7,  8, 13, m[s[12]], m[s[13]]); \
+	G(v, 3, 4,  9, 14, m[s[14]], m[s[15]]); \
+} while (0)
+
+static inline uint32_t load32(const uint8_t *p) {
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16
+		| (uint32_t) p[3] << 24;
+}
+
+static inline void store32(uint8_t *p, uint32_t w) {
+	p[0] = w;
+	p[1] = w >> 8;
+	p[2] = w >> 16;
+	p[3] = w >> 24;
+}
+
+/* Compress a single block, storing the new chaining value in out. */
+static void compress(const uint32_t cv[8], const uint8_t block[64],
+		uint8_t block_len, uint64_t counter, uint8_t flags, uint32_t out[8]) {
+	uint32_t m[16], v[16];
+
+	for (int i = 0; i < 16; ++i)
+		m[i] = load32(block + 4*i);
+
+	memcpy(v, cv, 8 * sizeof(uint32_t));
+	memcpy(v + 8, IV, 4 * sizeof(uint32_t));
+	v[12] = counter;
+	v[13] = counter >> 32;
+	v[14] = block_len;
+	v[15] = flags;
+
+	for (int r = 0; r < 7; ++r)
+		ROUND(v, m, r);
+
+	for (int i = 0; i < 8; ++i)
+		out[i] = v[i] ^ v[i+8];
+}
+
+/* Hash LANES whole chunks starting at input, the first of which has the number
+   counter, and store their chaining values in cvs. */
+static void hash_chunks(const uint8_t *input, uint64_t counter,
+		uint32_t cvs[LANES][8]) {
+	vec h[8], v[16], m[16], lo, hi;
+
+	for (int i = 0; i < 8; ++i)
+		for (int l = 0; l < LANES; ++l)
+			h[i][l] = IV[i];
+
+	for (int l = 0; l < LANES; ++l) {
+		lo[l] = counter + l;
+		hi[l] = (counter + l) >> 32;
+	}
+
+	for (int b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; ++b) {
+		uint32_t flags = (b == 0 ? CHUNK_START : 0)
+			| (b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1 ? CHUNK_END : 0);
+
+		for (int i = 0; i < 16; ++i)
+			for (int l = 0; l < LANES; ++l)
+				m[i][l] = load32(input + l*BLAKE3_CHUNK_LEN
+						+ b*BLAKE3_BLOCK_LEN + 4*i);
+
+		for (int i = 0; i < 8; ++i)
+			v[i] = h[i];
+		for (int l = 0; l < LANES; ++l) {
+			for (int i = 0; i < 4; ++i)
+				v[8+i][l] = IV[i];
+			v[14][l] = BLAKE3_BLOCK_LEN;
+			v[15][l] = flags;
+		}
+		v[12] = lo;
+		v[13] = hi;
+
+		for (int r = 0; r < 7; ++r)
+			ROUND(v, m, r);
+
+		for (int i = 0; i < 8; ++i)
+			h[i] = v[i] ^ v[i+8];
+	}
+
+	for (int l = 0; l < LANES; ++l)
+		for (int i = 0; i < 8; ++i)
+			cvs[l][i] = h[i][l];
+}
+
+static size_t chunk_len(const BLAKE3_CTX *ctx) {
+	return (size_t) ctx->blocks_compressed * BLAKE3_BLOCK_LEN
+		+ ctx->buffer_len;
+}
+
+static uint8_t chunk_start_flag(const BLAKE3_CTX *ctx) {
+	return ctx->blocks_compressed ? 0 : CHUNK_START;
+}
+
+static void chunk_reset(BLAKE3_CTX *ctx, uint64_t counter) {
+	memcpy(ctx->cv, IV, sizeof(IV));
+	ctx->chunk_counter = counter;
+	ctx->buffer_len = 0;
+	ctx->blocks_compressed = 0;
+}
+
+/* Add up to a chunk worth of data to the current chunk. The last block is
+   kept in the buffer, as it might need to be compressed with CHUNK_END. */
+static void chunk_update(BLAKE3_CTX *ctx, const uint8_t *data, size_t len) {
+	while (len) {
+		if (ctx->buffer_len == BLAKE3_BLOCK_LEN) {
+			compress(ctx->cv, ctx->buffer, BLAKE3_BLOCK_LEN,
+					ctx->chunk_counter, chunk_start_flag(ctx), ctx->cv);
+			ctx->blocks_compressed++;
+			ctx->buffer_len = 0;
+		}
+
+		size_t take = BLAKE3_BLOCK_LEN - ctx->buffer_len;
+		if (take > len)
+			take = len;
+
+		memcpy(ctx->buffer + ctx->buffer_len, data, take);
+		ctx->buffer_len += take;
+		data += take;
+		len -= take;
+	}
+}
+
+static output chunk_output(const BLAKE3_CTX *ctx) {
+	output out = {
+		.block_len = ctx->buffer_len,
+		.counter = ctx->chunk_counter,
+		.flags = chunk_start_flag(ctx) | CHUNK_END,
+	};
+
+	memcpy(out.cv, ctx->cv, sizeof(out.cv));
+	memcpy(out.block, ctx->buffer, ctx->buffer_len);
+	return out;
+}
+
+static output parent_output(const uint32_t left[8], const uint32_t right[8]) {
+	output out = {
+		.block_len = BLAKE3_BLOCK_LEN,
+		.flags = PARENT,
+	};
+
+	memcpy(out.cv, IV, sizeof(IV));
+	for (int i = 0; i < 8; ++i) {
+		store32(out.block + 4*i, left[i]);
+		store32(out.block + 32 + 4*i, right[i]);
+	}
+
+	return out;
+}
+
+static void output_cv(const output *out, uint32_t cv[8]) {
+	compress(out->cv, out->block, out->block_len, out->counter, out->flags, cv);
+}
+
+/* Push the chaining value of a finished chunk onto the stack, merging all
+   completed subtrees. Total is the number of chunks finished so far, or the
+   number of subtrees if cv belongs to a subtree instead of a chunk. */
+static void push_cv(BLAKE3_CTX *ctx, uint32_t cv[8], uint64_t total) {
+	uint32_t merged[8];
+	memcpy(merged, cv, sizeof(merged));
+
+	while (!(total & 1)) {
+		output parent = parent_output(ctx->cv_stack[--ctx->cv_stack_len],
+				merged);
+		output_cv(&parent, merged);
+		total >>= 1;
+	}
+
+	memcpy(ctx->cv_stack[ctx->cv_stack_len++], merged, sizeof(merged));
+}
+
+void BLAKE3_Init(BLAKE3_CTX *ctx) {
+	chunk_reset(ctx, 0);
+	ctx->cv_stack_len = 0;
+}
+
+void BLAKE3_Update(BLAKE3_CTX *ctx, const uint8_t *data, size_t len) {
+	while (len) {
+		/* only finish a chunk once we know it isn't the last one */
+		if (chunk_len(ctx) == BLAKE3_CHUNK_LEN) {
+			output out = chunk_output(ctx);
+			uint32_t cv[8];
+			output_cv(&out, cv);
+			push_cv(ctx, cv, ctx->chunk_counter + 1);
+			chunk_reset(ctx, ctx->chunk_counter + 1);
+		}
+
+		if (!chunk_len(ctx) && len > LANES * BLAKE3_CHUNK_LEN) {
+			uint32_t cvs[LANES][8];
+			hash_chunks(data, ctx->chunk_counter, cvs);
+
+			for (int l = 0; l < LANES; ++l)
+				push_cv(ctx, cvs[l], ctx->chunk_counter + l + 1);
+
+			chunk_reset(ctx, ctx->chunk_counter + LANES);
+			data += LANES * BLAKE3_CHUNK_LEN;
+			len -= LANES * BLAKE3_CHUNK_LEN;
+			continue;
+		}
+
+		size_t take = BLAKE3_CHUNK_LEN - chunk_len(ctx);
+		if (take > len)
+			take = len;
+
+		chunk_update(ctx, data, take);
+		data += take;
+		len -= take;
+	}
+}
+
+/* Returns the output of the root node of everything hashed so far. */
+static output final_output(const BLAKE3_CTX *ctx) {
+	output out = chunk_output(ctx);
+
+	for (int i = ctx->cv_stack_len - 1; i >= 0; --i) {
+		uint32_t cv[8];
+		output_cv(&out, cv);
+		out = parent_output(ctx->cv_stack[i], cv);
+	}
+
+	return out;
+}
+
+struct subtree_job {
+	const uint8_t *data;
+	uint64_t counter;   /* number of the first chunk of data */
+	size_t first;       /* first subtree hashed by this job */
+	size_t stride;      /* distance to the next one */
+	size_t count;       /* number of subtrees in data */
+	uint32_t (*cvs)[8]; /* chaining values of all subtrees */
+};
+
+/* Hash the subtrees of job, see BLAKE3_UpdateParallel(). */
+static void *subtree_worker(void *arg) {
+	struct subtree_job *job = arg;
+
+	for (size_t i = job->first; i < job->count; i += job->stride) {
+		BLAKE3_CTX sub;
+		BLAKE3_Init(&sub);
+		chunk_reset(&sub, job->counter + i*SUBTREE_CHUNKS);
+		BLAKE3_Update(&sub, job->data + i*SUBTREE_LEN, SUBTREE_LEN);
+
+		output out = final_output(&sub);
+		output_cv(&out, job->cvs[i]);
+	}
+
+	return NULL;
+}
+
+/* Works like BLAKE3_Update(), but uses up to threads threads. The input is
+   split into subtrees of SUBTREE_LEN bytes, which are hashed independently and
+   then merged in order, so the result is the same as without threads.
+   Neighbouring subtrees go to different threads, which keeps the accesses to a
+   file that isn't cached yet mostly sequential. */
+void BLAKE3_UpdateParallel(BLAKE3_CTX *ctx, const uint8_t *data, size_t len,
+		unsigned threads) {
+	/* the last subtree is left to BLAKE3_Update(), in case it's the root */
+	size_t count = len ? (len - 1) / SUBTREE_LEN : 0;
+	uint32_t (*cvs)[8] = NULL;
+
+	/* subtrees must start at a multiple of their size */
+	if (threads < 2 || count < 2 || chunk_len(ctx)
+			|| ctx->chunk_counter % SUBTREE_CHUNKS
+			|| !(cvs = malloc(count * sizeof(*cvs)))) {
+		BLAKE3_Update(ctx, data, len);
+		return;
+	}
+
+	if (threads > count)
+		threads = count;
+
+	struct subtree_job jobs[threads];
+	pthread_t tids[threads];
+	bool started[threads];
+
+	for (unsigned t = 0; t < threads; ++t) {
+		jobs[t] = (struct subtree_job) {
+			.data = data,
+			.counter = ctx->chunk_counter,
+			.first = t,
+			.stride = threads,
+			.count = count,
+			.cvs = cvs,
+		};
+
+		/* the first job runs on this thread, as does any job for which no
+		   thread could be created */
+		started[t] = t && !pthread_create(&tids[t], NULL, subtree_worker,
+				&jobs[t]);
+	}
+
+	for (unsigned t = 0; t < threads; ++t)
+		if (!started[t])
+			subtree_worker(&jobs[t]);
+
+	for (unsigned t = 0; t < threads; ++t)
+		if (started[t])
+			pthread_join(tids[t], NULL);
+
+	/* a subtree is merged like a single chunk one level further up */
+	uint64_t done = ctx->chunk_counter / SUBTREE_CHUNKS;
+	for (size_t i = 0; i < count; ++i)
+		push_cv(ctx, cvs[i], done + i + 1);
+
+	free(cvs);
+	chunk_reset(ctx, ctx->chunk_counter + count*SUBTREE_CHUNKS);
+	BLAKE3_Update(ctx, data + count*SUBTREE_LEN, len - count*SUBTREE_LEN);
+}
+
+void BLAKE3_Final(uint8_t digest[BLAKE3_DIGEST_SIZE], BLAKE3_CTX *ctx) {
+	output out = final_output(ctx);
+
+	uint32_t root[8];
+	compress(out.cv, out.block, out.block_len, 0, out.flags | ROOT, root);
+
+	for (int i = 0; i < 8; ++i)
+		store32(digest + 4*i, root[i]);
+}
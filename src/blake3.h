@@ -0,0 +1,35 @@
+/* blake3.h
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __RBLAKE3_H__
+#define __RBLAKE3_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_DIGEST_SIZE 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+
+typedef struct {
+	uint32_t cv[8];          /* chaining value of the current chunk */
+	uint64_t chunk_counter;
+	uint8_t buffer[BLAKE3_BLOCK_LEN];
+	uint8_t buffer_len;
+	uint8_t blocks_compressed;
+	uint8_t cv_stack_len;
+	uint32_t cv_stack[54][8]; /* enough for 2^64 bytes of input */
+} BLAKE3_CTX;
+
+void BLAKE3_Init(BLAKE3_CTX *ctx);
+void BLAKE3_Update(BLAKE3_CTX *ctx, const uint8_t *data, size_t len);
+void BLAKE3_UpdateParallel(BLAKE3_CTX *ctx, const uint8_t *data, size_t len,
+		unsigned threads);
+void BLAKE3_Final(uint8_t digest[BLAKE3_DIGEST_SIZE], BLAKE3_CTX *ctx);
+
+#endif
@@ -7,21 +7,31 @@
  */
 
 #define _XOPEN_SOURCE 700
+#define _GNU_SOURCE /* posix_spawn_file_actions_addchdir_np() */
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <sys/file.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
+#include <spawn.h>
 
-#include <libgen.h> /* dirname(), basename() */
 
-#include "sha1.h"
 #include "build.h"
+#include "depdb.h"
+#include "dircache.h"
+#include "gitindex.h"
+#include "hash.h"
+#include "jobs.h"
+#include "pathtab.h"
+#include "statcache.h"
 #include "util.h"
 #include "filepath.h"
 #include "DSV.h"
@@ -29,113 +39,163 @@
 #include "dbg.h"
 
 typedef struct do_attr {
-	char *specific;
-	char *general;
 	char *chosen;
+	char *dir;     /* directory of chosen */
+	char *target;  /* path of the target relative to dir */
+	char **missing; /* scripts that would be chosen instead if they existed */
+	size_t count;
 } do_attr;
 
+typedef struct prereq_buf {
+	char *buf;
+	size_t len;
+	size_t size;
+} prereq_buf;
+
 typedef struct dep_info {
 	const char *target;
 	char *path;
 	unsigned char *hash;
+	int hash_algo;
 	struct timespec ctime;
+	int magic;
 	int32_t flags;
 #define DEP_SOURCE (1 << 1)
+#define DEP_CHANGED (1 << 2) /* target changed in the run given by magic */
+#define DEP_PENDING (1 << 3) /* target was built, but not hashed yet */
 } dep_info;
 
-static do_attr *get_doscripts(const char *target);
-static void free_do_attr(do_attr *thing);
-static char **parse_shebang(char *target, char *doscript, char *temp_output);
-static char **parsecmd(char *cmd, size_t *i, size_t keep_free);
-static char *get_relpath(const char *target);
-static char *xrealpath(const char *path);
-static char *get_dep_path(const char *target);
+/* A target whose check is in progress, see check_target(). */
+typedef struct check_frame {
+	dep_info dep;
+	int ident;
+	bool need_result;
+	bool locked;
+	int lockfd;
+	bool stale;
+	bool decided; /* target was built or checked as its own prereq */
+	int retval;
+	char **targets; /* prereqs of a 'c' target, to be checked one by one */
+	char *idents;
+	size_t count;
+	size_t next;
+	size_t chain; /* 1 + index of the previous frame in the same bucket */
+	arena mark; /* scratch as it was before the frame was pushed */
+} check_frame;
+
+static do_attr *get_doscripts(arena *a, const char *target);
+static char **parse_shebang(arena *a, char *target, char *doscript,
+		char *temp_output);
+static char **parsecmd(arena *a, char *cmd, size_t *i, size_t keep_free);
+static char **doscript_env(arena *a, const char *target);
+static pid_t spawn(char **argv, char **envp, const char *dir);
+static const char *get_relpath(const char *target);
+static char *find_dep_path(arena *a, const char *target);
+static char *get_dep_path(arena *a, const char *target);
+static int read_dep_information(dep_info *dep);
 static void write_dep_information(dep_info *dep);
-static int handle_ident(dep_info *dep, int ident);
-static int handle_c(dep_info *dep);
-static void update_dep_info(dep_info *dep, const char *target);
-
-
-/* Build given target, using it's .do script. */
-static int build_target(dep_info *dep) {
+static int run_magic(void);
+static int check_target(const char *target, int ident, bool need_result);
+static bool begin_check(check_frame *f);
+static void end_check(check_frame *f);
+static int handle_ident(dep_info *dep, int ident, bool defer);
+static bool handle_c(check_frame *f, int status);
+static int handle_self(check_frame *f, int ident);
+static void finish_c(check_frame *f);
+static int resolve_pending(dep_info *dep);
+static void settle_job(void *arg);
+static bool settle_detached(const char *target);
+static unsigned char *hash_cached(const char *path, int fd,
+		const struct stat *st, int algo);
+static unsigned char *hash_path(const char *path, int algo, struct stat *st);
+static void update_dep_info(dep_info *dep, const char *target, int algo);
+static bool same_content(dep_info *dep, const unsigned char *hash, int algo);
+static int lock_target(const char *dep_path);
+static void unlock_target(const char *dep_path, int fd);
+static bool use_depdb(void);
+static char *load_entry(const char *path, size_t *len);
+static void store_entry(const char *path, const char *buf, size_t len,
+		bool append);
+static void remove_entry(const char *path);
+static void queue_prereq(prereq_buf *pb, const char *target, int ident);
+static void queue_prereq_path(prereq_buf *pb, const char *target, int ident);
+static void flush_prereqs(prereq_buf *pb, const char *parent);
+static void *graph_worker(void *arg);
+static void graph_explore_from(const char *target);
+static bool graph_clean(const dep_info *dep);
+static void graph_invalidate(const char *path);
+
+/* number of times build_target() was called by this process */
+static unsigned builds;
+
+/* memory of the targets being checked, released as soon as check_target() is
+   done with each of them */
+static arena scratch;
+
+
+/* Build given target, using it's .do script. If defer is true, the caller
+   doesn't care whether the target changed, so the new output is hashed by a
+   job of its own if a job slot is free, see settle_detached(). */
+static int build_target(dep_info *dep, bool defer) {
 	int retval = 1;
+	++builds;
 
 	/* get the .do script which we are going to execute */
-	do_attr *doscripts = get_doscripts(dep->target);
+	do_attr *doscripts = get_doscripts(&scratch, dep->target);
 	if (!doscripts->chosen) {
 		if (fexists(dep->target)) {
 			/* if our target file has no .do script associated but exists,
 			   then we treat it as a source */
-			dep->flags |= DEP_SOURCE;
-			if (!dep->hash) /* if the hash was retrieved, ctime was too */
-				update_dep_info(dep, dep->target);
+			dep->flags |= DEP_SOURCE | DEP_CHANGED;
+
+			struct stat st;
+			if (stat(dep->target, &st))
+				fatal("redo: failed to stat() %s", dep->target);
+
+			/* the hash is only valid if the ctime still matches, and it's
+			   only reused if it was computed with the current algorithm */
+			int algo = git_index_enabled() ? HASH_GITBLOB : hash_default();
+			if (!dep->hash || dep->hash_algo != algo
+					|| dep->ctime.tv_sec != st.st_ctim.tv_sec
+					|| dep->ctime.tv_nsec != st.st_ctim.tv_nsec) {
+				free(dep->hash);
+				update_dep_info(dep, dep->target, algo);
+			}
 
+			dep->magic = run_magic();
 			write_dep_information(dep);
-			goto exit;
+			return retval;
 		}
 
 		die("%s couldn't be built as no suitable .do script exists\n",
 				dep->target);
 	}
 
-	char *reltarget = get_relpath(dep->target);
+	const char *reltarget = get_relpath(dep->target);
 	if (!reltarget)
-		fatal("redo: failed to get realpath() of %s", reltarget);
+		fatal("redo: failed to get realpath() of %s", dep->target);
 
 	printf("\033[32mredo  \033[1m\033[37m%s\033[0m\n", reltarget);
-	free(reltarget);
 
 	/* remove old dependency record */
-	if (remove(dep->path) && errno != ENOENT)
-		fatal("redo: failed to remove %s", dep->path);
-
-	char *prereq = concat(2, dep->path, ".prereq");
-	if (remove(prereq) && errno != ENOENT)
-		fatal("redo: failed to remove %s", prereq);
-
-	free(prereq);
-
-	char *temp_output = concat(2, dep->target, ".redoing.tmp");
+	remove_entry(dep->path);
 
-	pid_t pid = fork();
-	if (pid == -1) {
-		/* failure */
-		fatal("redo: failed to fork() new process");
-	} else if (pid == 0) {
-		/* child */
-
-		char *abstemp = xrealpath(temp_output);
-		if (!abstemp)
-			fatal("redo: failed to get realpath() of %s", temp_output);
+	remove_entry(arena_concat(&scratch, 2, dep->path, ".prereq"));
 
-		/* change directory to our target */
-		char *dirc = xstrdup(doscripts->chosen);
-		char *ddoscript = dirname(dirc);
-		if (chdir(ddoscript) == -1)
-			fatal("redo: failed to change directory to %s", ddoscript);
+	char *temp_output = arena_concat(&scratch, 2, dep->target, ".redoing.tmp");
 
-		free(dirc);
+	/* everything the .do script needs is prepared here, see spawn() */
+	const char *abstemp = path_real(path_intern(temp_output));
+	if (!abstemp)
+		fatal("redo: failed to get realpath() of %s", temp_output);
 
-		char **argv = parse_shebang(xbasename(dep->target),
-				xbasename(doscripts->chosen), abstemp);
+	char **argv = parse_shebang(&scratch, doscripts->target,
+			doscripts->chosen, arena_strdup(&scratch, abstemp));
+	char **envp = doscript_env(&scratch,
+			path_real(path_intern(dep->target)));
 
-		/* set "REDO_PARENT_TARGET" */
-		if (setenv("REDO_PARENT_TARGET", dep->target, 1))
-			fatal("redo: failed to setenv() REDO_PARENT_TARGET to %s",
-					dep->target);
+	pid_t pid = spawn(argv, envp, doscripts->dir);
 
-		/* excelp() has nearly everything we want: automatic parsing of the
-		   shebang line through execve() and fallback to /bin/sh if no valid
-		   shebang could be found. However, it fails if the target doesn't have
-		   the executeable bit set, which is something we don't want. For this
-		   reason we parse the shebang line ourselves. */
-		execv(argv[0], argv);
-
-		/* execv should never return */
-		fatal("redo: failed to replace child process with %s", argv[0]);
-	}
-
-	/* parent */
 	int status;
 	if (waitpid(pid, &status, 0) == -1)
 		fatal("redo: waitpid() failed");
@@ -150,20 +210,54 @@ static int build_target(dep_info *dep) {
 		die("redo: invoked .do script did not terminate correctly\n");
 	}
 
+	/* whatever we knew about the target is outdated now, and the .do script
+	   might have changed the directory tree it ran in as well. Directories it
+	   replaced elsewhere aren't noticed by this process, which is the price
+	   for not resolving every path again after each build. */
+	stat_forget(dep->target);
+	path_forget(doscripts->dir);
+	dir_refresh();
+	graph_invalidate(dep->path);
+
 	/* check if our output file is > 0 bytes long */
 	if (fsize(temp_output) > 0) {
 		if (rename(temp_output, dep->target))
 			fatal("redo: failed to rename %s to %s", temp_output, dep->target);
 
-		/* recalculate hash after successful build */
-		unsigned char *old_hash = dep->hash;
-		update_dep_info(dep, dep->target);
-		if (old_hash)
-			retval = memcmp(dep->hash, old_hash, 20);
+		dep->flags &= ~DEP_SOURCE;
+		dep->magic = run_magic();
 
-		free(old_hash);
+		if (defer && jobs_parallel()) {
+			/* keep the hash of the previous build to compare against later */
+			struct stat st;
+			if (stat(dep->target, &st))
+				fatal("redo: failed to stat() %s", dep->target);
 
-		write_dep_information(dep);
+			dep->ctime = st.st_ctim;
+			dep->flags |= DEP_PENDING | DEP_CHANGED;
+			write_dep_information(dep);
+
+			/* hash the output in a free job slot while we and our caller go
+			   on, or right now if there is none */
+			if (!settle_detached(dep->target))
+				resolve_pending(dep);
+		} else {
+			/* recalculate hash after successful build */
+			unsigned char *old_hash = dep->hash;
+			int old_algo = dep->hash_algo;
+			update_dep_info(dep, dep->target, hash_default());
+			if (old_hash)
+				retval = !same_content(dep, old_hash, old_algo);
+
+			free(old_hash);
+
+			if (retval)
+				dep->flags |= DEP_CHANGED;
+			else
+				dep->flags &= ~DEP_CHANGED;
+
+			write_dep_information(dep);
+		}
 	} else {
 		if (remove(temp_output) && errno != ENOENT)
 			fatal("redo: failed to remove %s", temp_output);
@@ -172,40 +266,45 @@ static int build_target(dep_info *dep) {
 	/* depend on the .do script */
 	dep_info dep2 = {
 		.target = dep->target,
-		.path = get_dep_path(doscripts->chosen),
+		.path = get_dep_path(&scratch, doscripts->chosen),
+		.magic = run_magic(),
 	};
 
 	if (!dep2.path)
 		fatal("redo: failed to get realpath() of %s", doscripts->chosen);
 
-	if (!fexists(dep2.path)) {
-		update_dep_info(&dep2, doscripts->chosen);
+	size_t len;
+	char *record = load_entry(dep2.path, &len);
+	if (!record) {
+		update_dep_info(&dep2, doscripts->chosen, hash_default());
 		write_dep_information(&dep2);
 		free(dep2.hash);
 	}
-	free(dep2.path);
+	free(record);
 
-	add_prereq_path(doscripts->chosen, dep->target, 'c');
+	prereq_buf pb = {0};
+	queue_prereq_path(&pb, doscripts->chosen, 'c');
 
-	/* redo-ifcreate on specific if general was chosen */
-	if (doscripts->general == doscripts->chosen)
-		add_prereq_path(doscripts->specific, dep->target, 'e');
+	/* redo-ifcreate on every script that would have been chosen instead */
+	for (size_t i = 0; i < doscripts->count; ++i)
+		queue_prereq_path(&pb, doscripts->missing[i], 'e');
 
-	free(temp_output);
-exit:
-	free_do_attr(doscripts);
+	flush_prereqs(&pb, dep->target);
 
 	return retval;
 }
 
-/* Read and parse shebang and return an argv-like pointer array containing the
-   arguments. If no valid shebang could be found assume "/bin/sh -e" instead. */
-static char **parse_shebang(char *target, char *doscript, char *temp_output) {
+/* Read and parse the shebang of doscript and return an argv-like pointer array
+   containing the arguments, taken from a. If no valid shebang could be found
+   assume "/bin/sh -e" instead. The script itself is passed by its basename,
+   as it runs in its own directory. */
+static char **parse_shebang(arena *a, char *target, char *doscript,
+		char *temp_output) {
 	FILE *fp = fopen(doscript, "rb");
 	if (!fp)
 		fatal("redo: failed to open %s", doscript);
 
-	char *buf = xmalloc(1024);
+	char *buf = arena_alloc(a, 1024);
 
 	buf[ fread(buf, 1, 1023, fp) ] = '\0';
 	if (ferror(fp))
@@ -216,134 +315,252 @@ static char **parse_shebang(char *target, char *doscript, char *temp_output) {
 	char **argv;
 	size_t i = 0;
 	if (buf[0] == '#' && buf[1] == '!') {
-		argv = parsecmd(&buf[2], &i, 5);
+		argv = parsecmd(a, &buf[2], &i, 5);
 	} else {
-		argv = xmalloc(7 * sizeof(char*));
+		argv = arena_alloc(a, 7 * sizeof(char*));
 		argv[i++] = "/bin/sh";
 		argv[i++] = "-e";
 	}
 
-	argv[i++] = doscript;
+	argv[i++] = xbasename(doscript);
 	argv[i++] = target;
 	char *basename = remove_ext(target);
-	argv[i++] = basename;
+	argv[i++] = arena_strdup(a, basename);
+	free(basename);
 	argv[i++] = temp_output;
 	argv[i] = NULL;
 
 	return argv;
 }
 
-/* Breaks cmd at spaces and stores a pointer to each argument in the returned
-   array. The index i is incremented to point to the next free pointer. The
-   returned array is guaranteed to have at least keep_free entries left. */
-static char **parsecmd(char *cmd, size_t *i, size_t keep_free) {
-	size_t argv_len = 16;
-	char **argv = xmalloc(argv_len * sizeof(char*));
-	size_t j = 0;
+/* Breaks the first line of cmd at spaces and stores a pointer to each argument
+   in the returned array, taken from a. The index i is incremented to point to
+   the next free pointer. The returned array is guaranteed to have at least
+   keep_free entries left. */
+static char **parsecmd(arena *a, char *cmd, size_t *i, size_t keep_free) {
+	cmd[strcspn(cmd, "\r\n")] = '\0';
+
+	size_t count = 0;
+	for (size_t j = 0; cmd[j]; ++j)
+		if (cmd[j] != ' ' && (!j || cmd[j-1] == ' '))
+			++count;
+
+	char **argv = arena_alloc(a, (*i + count + keep_free) * sizeof(char*));
 	bool prev_space = true;
-	for (;; ++j) {
-		switch (cmd[j]) {
-		case ' ':
+	for (size_t j = 0; cmd[j]; ++j) {
+		if (cmd[j] == ' ') {
 			cmd[j] = '\0';
 			prev_space = true;
-			break;
-		case '\n':
-		case '\r':
-			cmd[j] = '\0';
-		case '\0':
-			return argv;
-		default:
-			if (!prev_space)
-				break;
-			/* check if we have enough space */
-			while (*i+keep_free >= argv_len) {
-				argv_len *= 2;
-				argv = xrealloc(argv, argv_len * sizeof(char*));
-			}
-
+		} else if (prev_space) {
 			prev_space = false;
-			argv[*i] = &cmd[j];
-			++*i;
+			argv[(*i)++] = &cmd[j];
 		}
 	}
-}
 
-/* Return a struct with all the possible .do scripts, and the chosen one. */
-static do_attr *get_doscripts(const char *target) {
-	do_attr *ds = xmalloc(sizeof(do_attr));
+	return argv;
+}
 
-	ds->specific = concat(2, target, ".do");
-	char *dirc = xstrdup(target);
-	char *dt = dirname(dirc);
+/* Return the environment for the .do script of target, taken from a. The
+   script might run in another directory than target, so target should be
+   absolute. */
+static char **doscript_env(arena *a, const char *target) {
+	extern char **environ;
+	static const char var[] = "REDO_PARENT_TARGET=";
 
-	ds->general = concat(4, dt, "/default", take_extension(target), ".do");
-	free(dirc);
+	size_t count = 0;
+	while (environ[count])
+		++count;
 
-	if (fexists(ds->specific))
-		ds->chosen = ds->specific;
-	else if (fexists(ds->general))
-		ds->chosen = ds->general;
-	else
-		ds->chosen = NULL;
+	char **envp = arena_alloc(a, (count + 2) * sizeof(*envp));
+	size_t j = 0;
+	for (size_t i = 0; i < count; ++i)
+		if (strncmp(environ[i], var, sizeof(var) - 1))
+			envp[j++] = environ[i];
 
-	return ds;
+	envp[j++] = arena_concat(a, 2, var, target);
+	envp[j] = NULL;
+	return envp;
 }
 
-/* Free the do_attr struct. */
-static void free_do_attr(do_attr *thing) {
-	free(thing->specific);
-	free(thing->general);
-	free(thing);
-}
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 29)
+#define HAVE_SPAWN_CHDIR
+#endif
+
+/* Start argv with the environment envp in dir. All the setup is done by the
+   caller, so with posix_spawn() the cost of starting a .do script doesn't grow
+   with the memory used by redo, as it would with fork(). Where posix_spawn()
+   can't change the directory, the child does nothing but that. */
+static pid_t spawn(char **argv, char **envp, const char *dir) {
+	pid_t pid;
+
+	/* excelp() has nearly everything we want: automatic parsing of the
+	   shebang line through execve() and fallback to /bin/sh if no valid
+	   shebang could be found. However, it fails if the target doesn't have
+	   the executeable bit set, which is something we don't want. For this
+	   reason we parse the shebang line ourselves. */
+#ifdef HAVE_SPAWN_CHDIR
+	posix_spawn_file_actions_t actions;
+	if ((errno = posix_spawn_file_actions_init(&actions)))
+		fatal("redo: failed to start %s", argv[0]);
+
+	if ((errno = posix_spawn_file_actions_addchdir_np(&actions, dir)))
+		fatal("redo: failed to change directory to %s", dir);
+
+	if ((errno = posix_spawn(&pid, argv[0], &actions, NULL, argv, envp)))
+		fatal("redo: failed to start %s", argv[0]);
+
+	posix_spawn_file_actions_destroy(&actions);
+#else
+	if ((pid = fork()) == -1)
+		fatal("redo: failed to fork() new process");
 
-/* Custom version of realpath that doesn't fail if the last part of path
-   doesn't exist and allocates memory for the result itself. */
-static char *xrealpath(const char *path) {
-	char *dirc = xstrdup(path);
-	char *dname = dirname(dirc);
-	char *absdir = realpath(dname, NULL);
+	if (pid == 0) {
+		if (chdir(dir) == -1)
+			fatal("redo: failed to change directory to %s", dir);
 
-	char *abstarget = NULL;
-	if (absdir)
-		abstarget = concat(3, absdir, "/", xbasename(path));
+		execve(argv[0], argv, envp);
 
-	free(dirc);
-	free(absdir);
-	return abstarget;
+		/* execve should never return */
+		fatal("redo: failed to replace child process with %s", argv[0]);
+	}
+#endif
+
+	return pid;
 }
 
-/* Return the relative path against "REDO_ROOT" of target. Returns NULL if
-   realpath() fails. */
-static char *get_relpath(const char *target) {
-	char *root = getenv("REDO_ROOT");
-	char *abstarget = xrealpath(target);
+/* Return a struct with the .do script chosen for target, if any, and the ones
+   that would have been chosen instead if they existed. All of it is taken
+   from a. */
+static do_attr *get_doscripts(arena *a, const char *target) {
+	do_attr *ds = arena_alloc(a, sizeof(do_attr));
+	*ds = (do_attr) {0};
 
+	const char *abstarget = path_real(path_intern(target));
 	if (!abstarget)
-		return NULL;
+		return ds;
+
+	char *root = getenv("REDO_ROOT");
+	size_t rootlen = root[1] ? strlen(root) : 0;
+
+	char *abscopy = arena_strdup(a, abstarget);
+	char *dir = arena_strdup(a, abstarget);
+	char *base = strrchr(dir, '/');
+	*base++ = '\0';
+
+	/* there's at most one candidate per directory, plus target.do */
+	size_t size = 2;
+	for (char *p = dir; *p; ++p)
+		size += *p == '/';
+	ds->missing = arena_alloc(a, size * sizeof(*ds->missing));
+
+	char *general = arena_concat(a, 3, "default", take_extension(base), ".do");
+	char *name = arena_concat(a, 2, base, ".do");
+
+	for (;;) {
+		char *path = arena_concat(a, 3, dir, "/", name);
+		if (dir_has_doscript(*dir ? dir : "/", name)) {
+			ds->chosen = path;
+			ds->dir = *dir ? dir : "/";
+			ds->target = abscopy + strlen(dir) + 1;
+			break;
+		}
+		ds->missing[ds->count++] = path;
 
-	char *path = xstrdup(relpath(abstarget, root));
-	free(abstarget);
-	return path;
+		if (name != general) {
+			name = general;
+			continue;
+		}
+
+		/* repeat for ../, except if we are already in REDO_ROOT */
+		if (strncmp(dir, root, rootlen) || dir[rootlen] != '/')
+			break;
+
+		*strrchr(dir, '/') = '\0';
+	}
+
+	return ds;
 }
 
-/* Return the dependency record path of target. */
-static char *get_dep_path(const char *target) {
-	char *root = getenv("REDO_ROOT");
-	char *dep_path;
-	char *reltarget = get_relpath(target);
+/* Return the relative path against "REDO_ROOT" of target. Returns NULL if
+   realpath() fails. The result is only valid until the next build. */
+static const char *get_relpath(const char *target) {
+	return path_rel(path_intern(target));
+}
+
+/* Return the dependency record path of target, taken from a, without creating
+   any directories. */
+static char *find_dep_path(arena *a, const char *target) {
+	const char *reltarget = get_relpath(target);
 	if (!reltarget)
 		return NULL;
 
-	char *redodir = is_absolute(reltarget) ? "/.redo/abs/" : "/.redo/rel/";
-	dep_path = concat(3, root, redodir, reltarget);
+	char *redodir = is_absolute(reltarget) ? "/.redo/abs" : "/.redo/rel/";
+	return arena_concat(a, 3, getenv("REDO_ROOT"), redodir, reltarget);
+}
 
-	/* create directory */
-	mkpath(dep_path, 0755); /* TODO: should probably be somewhere else */
+/* Return the dependency record path of target, taken from a. */
+static char *get_dep_path(arena *a, const char *target) {
+	char *dep_path = find_dep_path(a, target);
+	if (!dep_path || use_depdb())
+		return dep_path;
+
+	/* create directory, once per process */
+	unsigned id = path_intern(dep_path);
+	if (!path_made(id)) {
+		mkpath(dep_path, 0755); /* TODO: should probably be somewhere else */
+		path_set_made(id);
+	}
 
-	free(reltarget);
 	return dep_path;
 }
 
+/* Append the line "<ident>:<target>" to the batch pb. */
+static void queue_prereq(prereq_buf *pb, const char *target, int ident) {
+	size_t need = pb->len + strlen(target)*2 + 4;
+	if (need > pb->size) {
+		pb->size = need > pb->size*2 ? need : pb->size*2;
+		pb->buf = pb->buf ? xrealloc(pb->buf, pb->size) : xmalloc(pb->size);
+	}
+
+	char *line = pb->buf + pb->len;
+	line[0] = ident;
+	line[1] = ':';
+	size_t encoded_len = encode_string(line+2, target) + 3;
+	line[encoded_len-1] = '\n';
+
+	pb->len += encoded_len;
+}
+
+/* Like queue_prereq(), except that the relative path of target to REDO_ROOT is
+   used. */
+static void queue_prereq_path(prereq_buf *pb, const char *target, int ident) {
+	const char *reltarget = get_relpath(target);
+	if (!reltarget)
+		fatal("redo: failed to get realpath() of %s", target);
+
+	queue_prereq(pb, reltarget, ident);
+}
+
+/* Record all prereqs in pb for parent and free the batch. The lines are
+   appended with a single write, so concurrent writers and crashes never leave
+   a partial line behind. */
+static void flush_prereqs(prereq_buf *pb, const char *parent) {
+	if (pb->len) {
+		char *base_path = get_dep_path(NULL, parent);
+		if (!base_path)
+			fatal("redo: failed to get realpath() of %s", parent);
+
+		char *dep_path = concat(2, base_path, ".prereq");
+		store_entry(dep_path, pb->buf, pb->len, true);
+
+		free(dep_path);
+		free(base_path);
+	}
+
+	free(pb->buf);
+	*pb = (prereq_buf) {0};
+}
+
 /* Declare that parent depends on target in the specific way ident.
  * Parent must be a path pointing to a (maybe non-existent) file in a valid,
  * exisiting directory. Target can be any string.
@@ -352,233 +569,1206 @@ static char *get_dep_path(const char *target) {
  *     <ident>:<target>
  */
 void add_prereq(const char *target, const char *parent, int ident) {
-	char *base_path = get_dep_path(parent);
-	if (!base_path)
-		fatal("redo: failed to get realpath() of %s", parent);
+	prereq_buf pb = {0};
+	queue_prereq(&pb, target, ident);
+	flush_prereqs(&pb, parent);
+}
 
-	char *dep_path = concat(2, base_path, ".prereq");
+/* Works like add_prereq(), except that it uses the relative path of target to
+ * REDO_ROOT instead of just the target. Target must be a path pointing to a
+ * (maybe non-existant) file in a valid existing directory.
+ */
+void add_prereq_path(const char *target, const char *parent, int ident) {
+	add_prereqs_path(1, &target, parent, ident);
+}
 
-	int fd = open(dep_path, O_WRONLY | O_APPEND | O_CREAT, 0644);
-	if (fd < 0)
-		fatal("redo: failed to open %s", dep_path);
+/* Works like add_prereq_path() for all count targets, but records them at once.
+ */
+void add_prereqs_path(int count, const char *targets[], const char *parent,
+		int ident) {
+	prereq_buf pb = {0};
+	for (int i = 0; i < count; ++i)
+		queue_prereq_path(&pb, targets[i], ident);
+
+	flush_prereqs(&pb, parent);
+}
 
-	size_t bufsize = strlen(target)*2 + 3;
-	char *buf = xmalloc(bufsize);
+/* Returns the path of the hash cache entry of the file with the metadata st. */
+static char *hash_cache_path(const struct stat *st) {
+	char name[64];
+	snprintf(name, sizeof(name), "/.redo/hash/%jx-%jx", (uintmax_t) st->st_dev,
+			(uintmax_t) st->st_ino);
+	return concat(2, getenv("REDO_ROOT"), name);
+}
 
-	buf[0] = ident;
-	buf[1] = ':';
-	size_t encoded_len = encode_string(buf+2, target) + 3;
-	buf[encoded_len-1] = '\n';
+/* Like hash_file(), but first looks the file up in the hash cache, which maps
+   the inode of a file to its hash as long as size, mtime and ctime match. This
+   way each version of a file is only hashed once, no matter under how many
+   names it is known. Each entry is only ever appended to, as concurrent
+   writers would otherwise have to be locked out, and starts over when it grows
+   too large. Git blob ids of files git considers unchanged are taken straight
+   from its index, see gitindex.c. */
+static unsigned char *hash_cached(const char *path, int fd,
+		const struct stat *st, int algo) {
+	if (algo == HASH_GITBLOB) {
+		unsigned char *oid = xmalloc(GIT_OID_SIZE);
+		if (git_index_lookup(path, st, oid))
+			return oid;
+
+		free(oid);
+	}
 
-	if (write(fd, buf, encoded_len) < (ssize_t) encoded_len)
-		fatal("redo: failed to write to %s", dep_path);
+	if (st->st_size < HASH_CACHE_MIN || algo == HASH_STAT)
+		return hash_file(fd, st->st_size, algo);
 
-	if (close(fd))
-		fatal("redo: failed to close %s", dep_path);
+	char key[128];
+	int key_len = snprintf(key, sizeof(key), "%jd:%lld.%.9ld:%lld.%.9ld:",
+			(intmax_t) st->st_size,
+			(long long) st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+			(long long) st->st_ctim.tv_sec, st->st_ctim.tv_nsec);
+	assert(key_len > 0 && key_len < (int) sizeof(key));
+
+	char *cache_path = hash_cache_path(st);
+	unsigned char *hash = xmalloc(HASH_MAX_SIZE);
+	size_t len;
+
+	char *entry = load_entry(cache_path, &len);
+	if (entry) {
+		for (char *line = entry, *end; *line; line = end + 1) {
+			if (!(end = strchr(line, '\n')))
+				break;
+
+			*end = '\0';
+			if (!strncmp(line, key, key_len)
+					&& hash_parse(line + key_len, hash) == algo)
+				goto exit;
+		}
+	}
+
+	/* files changed within the last second might change again without
+	   getting a different ctime, so they aren't cached */
+	struct timespec now;
+	if (clock_gettime(CLOCK_REALTIME, &now))
+		fatal("redo: failed to get the current time");
+
+	free(hash);
+	hash = hash_file(fd, st->st_size, algo);
+
+	if (st->st_ctim.tv_sec < now.tv_sec - 1) {
+		char line[sizeof(key) + HASH_FIELD_MAX + 1];
+		memcpy(line, key, key_len);
+		size_t line_len = key_len + hash_format(algo, hash, line + key_len);
+		line[line_len++] = '\n';
 
-	free(buf);
-	free(dep_path);
-	free(base_path);
+		if (entry && len > 4096)
+			remove_entry(cache_path);
+		else if (!entry && !use_depdb())
+			mkpath(cache_path, 0755);
+
+		store_entry(cache_path, line, line_len, true);
+	}
+
+exit:
+	free(entry);
+	free(cache_path);
+	return hash;
 }
 
-/* Works like add_prereq(), except that it uses the relative path of target to
- * REDO_ROOT instead of just the target. Target must be a path pointing to a
- * (maybe non-existant) file in a valid existing directory.
- */
-void add_prereq_path(const char *target, const char *parent, int ident) {
-	char *reltarget = get_relpath(target);
-	if (!reltarget)
-		fatal("redo: failed to get realpath() of %s", target);
+/* Hash the file at path with algo and store its metadata in st. */
+static unsigned char *hash_path(const char *path, int algo, struct stat *st) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		fatal("redo: failed to open %s", path);
+
+	if (fstat(fd, st))
+		fatal("redo: failed to aquire stat() %s", path);
 
-	add_prereq(reltarget, parent, ident);
-	free(reltarget);
+	unsigned char *hash = hash_cached(path, fd, st, algo);
+	close(fd);
+	return hash;
 }
 
 /* Update hash & ctime information stored in the given dep_info struct */
-static void update_dep_info(dep_info *dep, const char *target) {
-	FILE *fp = fopen(target, "rb");
-	if (!fp)
-		fatal("redo: failed to open %s", target);
+static void update_dep_info(dep_info *dep, const char *target, int algo) {
+	struct stat st;
+	dep->hash_algo = algo;
+	dep->hash = hash_path(target, dep->hash_algo, &st);
+	dep->ctime = st.st_ctim;
+}
+
+/* Returns true if the target of dep, which was just hashed by
+   update_dep_info(), has the contents described by hash. If hash was computed
+   with a different algorithm, the target is hashed again with that one, so that
+   switching algorithms doesn't rebuild anything. */
+static bool same_content(dep_info *dep, const unsigned char *hash, int algo) {
+	if (algo == dep->hash_algo)
+		return !memcmp(dep->hash, hash, hash_size(algo));
 
-	dep->hash = hash_file(fp);
 	struct stat st;
-	if (fstat(fileno(fp), &st))
-		fatal("redo: failed to aquire stat() %s", target);
+	unsigned char *other = hash_path(dep->target, algo, &st);
+	bool same = !memcmp(other, hash, hash_size(algo));
 
-	dep->ctime = st.st_ctim;
-	fclose(fp);
+	free(other);
+	return same;
 }
 
-/* Write the dependency information into the specified path. */
-static void write_dep_information(dep_info *dep) {
-	FILE *fd = fopen(dep->path, "w+");
-	if (!fd)
-		fatal("redo: failed to open %s", dep->path);
+/* Read the dependency record of dep. Returns 0 on success, -1 if no record
+   exists and 1 if the record couldn't be parsed. */
+static int read_dep_information(dep_info *dep) {
+	struct dsv_ctx ctx;
+	int retval = 0;
+	size_t len;
 
-	char hash[41];
-	sha1_to_hex(dep->hash, hash);
-	char *flags = (dep->flags & DEP_SOURCE) ? "s" : "l";
+	char *record = load_entry(dep->path, &len);
+	if (!record)
+		return -1;
+
+	dsv_init(&ctx, 4);
 
-	int magic = atoi(getenv("REDO_MAGIC"));
+	if (dsv_parse_in_place(&ctx, record, len)) {
+		retval = 1;
+		goto exit;
+	}
+
+	char *end;
+	if (sscanf(ctx.fields[1], "%lld.%ld", (long long*)&dep->ctime.tv_sec,
+				&dep->ctime.tv_nsec) < 2) {
+		log_info("%s: ctime parsing failed\n", dep->target);
+		retval = 1;
+	} else {
+		dep->magic = strtol(ctx.fields[2], &end, 10);
+		if (*end)
+			retval = 1;
+	}
+
+	dep->flags = 0;
+	if (ctx.fields[3][0] == 's')
+		dep->flags |= DEP_SOURCE;
+	if (strchr(ctx.fields[3], 'c'))
+		dep->flags |= DEP_CHANGED;
+	if (strchr(ctx.fields[3], 'p'))
+		dep->flags |= DEP_PENDING;
+
+	/* a target that was never hashed has no hash until it is resolved */
+	unsigned char hash[HASH_MAX_SIZE];
+	if (retval || (dep->flags & DEP_PENDING && !strcmp(ctx.fields[0], "-"))) {
+		dep->hash_algo = hash_default();
+	} else if ((dep->hash_algo = hash_parse(ctx.fields[0], hash)) < 0) {
+		log_info("%s: hash parsing failed\n", dep->target);
+		retval = 1;
+	} else {
+		dep->hash = xmalloc(hash_size(dep->hash_algo));
+		memcpy(dep->hash, hash, hash_size(dep->hash_algo));
+	}
+
+exit:
+	dsv_free(&ctx);
+	free(record);
+	return retval;
+}
+
+/* Returns the magic number identifying the current run. */
+static int run_magic(void) {
+	static int magic = -1;
+	if (magic < 0)
+		magic = atoi(getenv("REDO_MAGIC"));
+
+	return magic;
+}
+
+/* Write the dependency information into the specified path. The record is
+   stamped with the magic number of the run that checked it, usually
+   run_magic(). */
+static void write_dep_information(dep_info *dep) {
+	char hash[HASH_FIELD_MAX + 1] = "-";
+	if (dep->hash)
+		hash_format(dep->hash_algo, dep->hash, hash);
+	char *flags = (dep->flags & DEP_SOURCE) ? "s" : "l";
+	char *changed = (dep->flags & DEP_CHANGED) ? "c" : "";
+	char *pending = (dep->flags & DEP_PENDING) ? "p" : "";
 
 	/* TODO: casting time_t to long long is probably not entirely portable */
-	if (fprintf(fd, "%s:%lld.%.9ld:%010d:%s\n", hash,
-			(long long)dep->ctime.tv_sec, dep->ctime.tv_nsec, magic, flags) < 0)
-		fatal("redo: failed to write to %s", dep->path);
+	char buf[HASH_FIELD_MAX + 64];
+	int len = snprintf(buf, sizeof(buf), "%s:%lld.%.9ld:%010d:%s%s%s\n", hash,
+			(long long)dep->ctime.tv_sec, dep->ctime.tv_nsec, dep->magic, flags,
+			changed, pending);
+	assert(len > 0 && len < (int) sizeof(buf));
+
+	store_entry(dep->path, buf, len, false);
+}
+
+/* Returns true if the dependency store is kept in a single database file
+   instead of one file per record, see depdb.c. */
+static bool use_depdb(void) {
+	static int state = -1;
+	if (state < 0)
+		state = depdb_open(getenv("REDO_ROOT"));
 
-	if (fclose(fd))
-		fatal("redo: failed to close %s", dep->path);
+	return state;
+}
+
+/* Returns the database key of the dependency store path. */
+static const char *depdb_key(const char *path) {
+	return path + strlen(getenv("REDO_ROOT")) + strlen("/.redo/");
+}
+
+/* Return the contents of the dependency store entry at path, or NULL if it
+   doesn't exist. The returned buffer is always null-terminated. */
+static char *load_entry(const char *path, size_t *len) {
+	if (use_depdb())
+		return depdb_get(depdb_key(path), len);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			fatal("redo: failed to open %s", path);
+
+		return NULL;
+	}
+
+	size_t size = 1024;
+	char *buf = xmalloc(size);
+	ssize_t r;
+
+	*len = 0;
+	while ((r = read(fd, buf + *len, size - *len - 1))) {
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("redo: failed to read from %s", path);
+		}
+
+		*len += r;
+		if (*len + 1 == size)
+			buf = xrealloc(buf, size *= 2);
+	}
+
+	buf[*len] = '\0';
+	close(fd);
+	return buf;
+}
+
+/* Replace or extend the dependency store entry at path with buf. */
+static void store_entry(const char *path, const char *buf, size_t len,
+		bool append) {
+	if (use_depdb()) {
+		if (append)
+			depdb_append(depdb_key(path), buf, len);
+		else
+			depdb_put(depdb_key(path), buf, len);
+		return;
+	}
+
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+	int fd = open(path, flags, 0644);
+	if (fd < 0)
+		fatal("redo: failed to open %s", path);
+
+	if (write(fd, buf, len) < (ssize_t) len)
+		fatal("redo: failed to write to %s", path);
+
+	if (close(fd))
+		fatal("redo: failed to close %s", path);
+}
+
+static void remove_entry(const char *path) {
+	if (use_depdb())
+		depdb_remove(depdb_key(path));
+	else if (remove(path) && errno != ENOENT)
+		fatal("redo: failed to remove %s", path);
+}
+
+/* Buckets of the frames on the stack of check_target(), by record path. */
+#define CHECK_BUCKETS 1024
+
+static size_t path_bucket(const char *path) {
+	uint32_t h = 2166136261u;
+	for (; *path; ++path)
+		h = (h ^ (unsigned char) *path) * 16777619u;
+
+	return h % CHECK_BUCKETS;
+}
+
+/* Bring target up to date according to ident. Returns true if it changed during
+   this run, which is only known for certain if need_result is true.
+
+   Chains of prereqs can be thousands of targets deep, so instead of recursing
+   into every prereq, the targets being checked are kept on an explicit stack,
+   each only holding its list of prereqs. A prereq that is already on the
+   stack would form a cycle, and is skipped. */
+static int check_target(const char *target, int ident, bool need_result) {
+	size_t depth = 0, size = 16;
+	check_frame *stack = xmalloc(size * sizeof(*stack));
+	size_t buckets[CHECK_BUCKETS] = {0};
+	int retval;
+
+	arena mark = scratch;
+	stack[depth++] = (check_frame) {
+		.dep = { .target = target, .path = get_dep_path(&scratch, target) },
+		.ident = ident,
+		.need_result = need_result,
+		.mark = mark,
+	};
+
+	for (;;) {
+		check_frame *f = &stack[depth - 1];
+
+		if (!f->targets && !begin_check(f)) {
+			/* the prereqs of f have to be checked first */
+			if (f->dep.path) {
+				size_t b = path_bucket(f->dep.path);
+				f->chain = buckets[b];
+				buckets[b] = depth;
+			}
+			continue;
+		}
+
+		if (f->targets && f->next < f->count && !f->retval) {
+			const char *prereq = f->targets[f->next];
+			int prereq_ident = f->idents[f->next];
+			arena mark = scratch;
+			char *path = get_dep_path(&scratch, prereq);
+
+			size_t k = path ? buckets[path_bucket(path)] : 0;
+			while (k && strcmp(stack[k - 1].dep.path, path))
+				k = stack[k - 1].chain;
+
+			if (k == depth && (prereq_ident == 'a' || prereq_ident == 'e')) {
+				/* redo-always and redo-ifcreate record the target as its own
+				   prereq, which just means it has to be built again */
+				arena_release(&scratch, &mark);
+				f->retval = handle_self(f, prereq_ident);
+				f->next = f->decided ? f->count : f->next + 1;
+				continue;
+			} else if (k) {
+				log_err("redo: %s depends on itself\n", prereq);
+				arena_release(&scratch, &mark);
+				++f->next;
+				continue;
+			}
+
+			/* f is invalid once the stack moves */
+			if (depth == size)
+				stack = xrealloc(stack, (size *= 2) * sizeof(*stack));
+
+			stack[depth++] = (check_frame) {
+				.dep = { .target = prereq, .path = path },
+				.ident = prereq_ident,
+				.need_result = true,
+				.mark = mark,
+			};
+			continue;
+		}
+
+		if (f->targets) {
+			if (f->dep.path)
+				buckets[path_bucket(f->dep.path)] = f->chain;
+			finish_c(f);
+		}
+
+		retval = f->retval;
+		end_check(f);
+
+		if (!--depth)
+			break;
+
+		f = &stack[depth - 1];
+		if (retval) {
+			log_info("%s ood: subtarget(s) ood\n", f->dep.target);
+			f->retval = 1;
+		}
+		++f->next;
+	}
+
+	free(stack);
+	return retval;
+}
+
+/* Start checking the target of f. Returns true if that's already done, or
+   false if its prereqs have to be checked first, which are then stored in f
+   and finish_c() has to be called afterwards. */
+static bool begin_check(check_frame *f) {
+	dep_info *dep = &f->dep;
+
+	if (!dep->path) {
+		f->retval = 1;
+		return true;
+	}
+
+	/* other jobs might be working on the same target right now */
+	if (jobs_parallel()) {
+		f->lockfd = lock_target(dep->path);
+		f->locked = true;
+	}
+
+	int status = read_dep_information(dep);
+	if (!status && (dep->flags & DEP_PENDING)
+			&& (f->need_result || dep->magic != run_magic()))
+		status = resolve_pending(dep);
+
+	if (!status && dep->magic == run_magic()) {
+		/* target was already checked or built during this run */
+		f->retval = (dep->flags & DEP_CHANGED) ? 1 : 0;
+		return true;
+	} else if (f->ident == 'c') {
+		return handle_c(f, status);
+	}
+
+	f->retval = handle_ident(dep, f->ident, !f->need_result);
+	return true;
+}
+
+static void end_check(check_frame *f) {
+	if (f->locked)
+		unlock_target(f->dep.path, f->lockfd);
+
+	free(f->dep.hash);
+	arena_release(&scratch, &f->mark);
 }
 
 int update_target(const char *target, int ident) {
+	if (ident == 'c')
+		graph_explore_from(target);
+
+	return check_target(target, ident, false);
+}
+
+/* Checking whether a big graph is up to date is dominated by waiting for the
+   records and the metadata of its targets. So before a target is checked, its
+   prereq graph is explored by a few threads at once, each of them taking a job
+   slot, which don't modify anything: a target is clean by itself if its record
+   is valid and the ctime of its file still matches it. Only if all of its
+   prereqs are clean as well, handle_c() doesn't have to descend into it. A
+   target that was built isn't clean anymore, and neither is anything that
+   depends on it, see graph_invalidate(). */
+
+#define GRAPH_THREADS 8
+/* another thread is started for every this many targets waiting */
+#define GRAPH_BACKLOG 64
+
+typedef struct graph_node {
+	char *target;
+	char *path;
+	int ident;
+	bool clean;
+	int verdict; /* 1 if the target and all its prereqs are clean, -1 if not */
+	struct graph_node **prereqs;
+	size_t count;
+	size_t next; /* prereqs already found clean by graph_verdict() */
+	struct graph_node **parents; /* nodes having this one as a prereq */
+	size_t nparents, parents_size;
+} graph_node;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	graph_node **slots; /* open addressing on path and ident */
+	size_t size, used;
+	graph_node **queue;
+	size_t queued, queue_size;
+	size_t busy;
+	pthread_t threads[GRAPH_THREADS];
+	size_t nthreads;
+} graph = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static size_t graph_slot(const char *path, int ident) {
+	uint32_t h = 2166136261u ^ (unsigned char) ident;
+	for (; *path; ++path)
+		h = (h ^ (unsigned char) *path) * 16777619u;
+
+	return h & (graph.size - 1);
+}
+
+/* Return the node of path and ident, or NULL if it wasn't explored. */
+static graph_node *graph_find(const char *path, int ident) {
+	if (!graph.size)
+		return NULL;
+
+	for (size_t i = graph_slot(path, ident); graph.slots[i];
+			i = (i + 1) & (graph.size - 1))
+		if (graph.slots[i]->ident == ident && !strcmp(graph.slots[i]->path, path))
+			return graph.slots[i];
+
+	return NULL;
+}
+
+/* Add the node for target to the graph and queue it for exploration, unless
+   it's already known. Takes ownership of target and path, and must be called
+   with the lock held. */
+static graph_node *graph_add(char *target, char *path, int ident) {
+	graph_node *node = graph_find(path, ident);
+	if (node) {
+		free(target);
+		free(path);
+		return node;
+	}
+
+	if ((graph.used + 1) * 2 > graph.size) {
+		graph_node **old = graph.slots;
+		size_t old_size = graph.size;
+
+		graph.size = old_size ? old_size * 2 : 1024;
+		graph.slots = xmalloc(graph.size * sizeof(*graph.slots));
+		memset(graph.slots, 0, graph.size * sizeof(*graph.slots));
+		for (size_t i = 0; i < old_size; ++i) {
+			if (!old[i])
+				continue;
+
+			size_t j = graph_slot(old[i]->path, old[i]->ident);
+			while (graph.slots[j])
+				j = (j + 1) & (graph.size - 1);
+			graph.slots[j] = old[i];
+		}
+		free(old);
+	}
+
+	node = xmalloc(sizeof(*node));
+	*node = (graph_node) { .target = target, .path = path, .ident = ident };
+
+	size_t i = graph_slot(path, ident);
+	while (graph.slots[i])
+		i = (i + 1) & (graph.size - 1);
+	graph.slots[i] = node;
+	++graph.used;
+
+	if (graph.queued == graph.queue_size) {
+		if (graph.queue_size) {
+			graph.queue_size *= 2;
+			graph.queue = xrealloc(graph.queue,
+					graph.queue_size * sizeof(*graph.queue));
+		} else {
+			graph.queue_size = 64;
+			graph.queue = xmalloc(graph.queue_size * sizeof(*graph.queue));
+		}
+	}
+	graph.queue[graph.queued++] = node;
+	pthread_cond_signal(&graph.cond);
+
+	return node;
+}
+
+/* Remember that parent has node as a prereq. Must be called with the lock
+   held. */
+static void graph_link(graph_node *node, graph_node *parent) {
+	if (node->nparents == node->parents_size) {
+		node->parents_size = node->parents_size ? node->parents_size * 2 : 4;
+		node->parents = node->parents
+			? xrealloc(node->parents,
+					node->parents_size * sizeof(*node->parents))
+			: xmalloc(node->parents_size * sizeof(*node->parents));
+	}
+
+	node->parents[node->nparents++] = parent;
+}
+
+/* Find out whether node is clean by itself, and add its prereqs to the graph
+   if it is. Mirrors check_target() and handle_c() without writing anything. */
+static void graph_explore(graph_node *node) {
+	struct stat st;
+	node->clean = false;
+
+	if (node->ident == 'e') {
+		node->clean = stat(node->target, &st) && errno == ENOENT;
+		return;
+	} else if (node->ident != 'c') {
+		return;
+	}
+
+	dep_info dep = { .target = node->target, .path = node->path };
+	if (read_dep_information(&dep) || (dep.flags & DEP_PENDING))
+		goto exit;
+
+	if (dep.magic == run_magic()) {
+		/* already checked during this run, nothing to descend into */
+		node->clean = !(dep.flags & DEP_CHANGED);
+		goto exit;
+	}
+
+	if ((dep.hash_algo == HASH_STAT && hash_default() != HASH_STAT)
+			|| stat(node->target, &st)
+			|| dep.ctime.tv_sec != st.st_ctim.tv_sec
+			|| dep.ctime.tv_nsec != st.st_ctim.tv_nsec)
+		goto exit;
+
+	char *prereq_path = concat(2, node->path, ".prereq");
+	size_t len, off = 0;
+	char *prereqs = load_entry(prereq_path, &len);
+	free(prereq_path);
+
+	size_t count = 0, size = 16;
+	char **targets = xmalloc(size * sizeof(*targets));
+	char **paths = xmalloc(size * sizeof(*paths));
+	char *idents = xmalloc(size);
+	bool clean = true;
+
+	struct dsv_ctx ctx;
+	dsv_init(&ctx, 2);
+
+	while (prereqs && off < len && !dsv_parse_in_place(&ctx, prereqs + off,
+				len - off)) {
+		off += ctx.processed;
+
+		if (count == size) {
+			size *= 2;
+			targets = xrealloc(targets, size * sizeof(*targets));
+			paths = xrealloc(paths, size * sizeof(*paths));
+			idents = xrealloc(idents, size);
+		}
+
+		targets[count] = make_abs(getenv("REDO_ROOT"), ctx.fields[1]);
+		idents[count] = ctx.fields[0][0];
+		if (!(paths[count] = find_dep_path(NULL, targets[count]))) {
+			/* check_target() considers these out of date */
+			free(targets[count]);
+			clean = false;
+			break;
+		}
+		++count;
+	}
+
+	dsv_free(&ctx);
+	free(prereqs);
+
+	pthread_mutex_lock(&graph.lock);
+	if (clean) {
+		node->clean = true;
+		node->count = count;
+		node->prereqs = xmalloc((count + 1) * sizeof(*node->prereqs));
+		for (size_t i = 0; i < count; ++i) {
+			node->prereqs[i] = graph_add(targets[i], paths[i], idents[i]);
+			graph_link(node->prereqs[i], node);
+		}
+
+		if (graph.nthreads < GRAPH_THREADS
+				&& graph.queued > GRAPH_BACKLOG * (graph.nthreads + 1)
+				&& jobs_borrow(1)) {
+			if (!pthread_create(&graph.threads[graph.nthreads], NULL,
+						graph_worker, NULL))
+				++graph.nthreads;
+		}
+	} else {
+		for (size_t i = 0; i < count; ++i) {
+			free(targets[i]);
+			free(paths[i]);
+		}
+	}
+	pthread_mutex_unlock(&graph.lock);
+
+	free(targets);
+	free(paths);
+	free(idents);
+exit:
+	free(dep.hash);
+}
+
+/* Explore queued nodes until all are done. */
+static void *graph_worker(void *arg) {
+	(void) arg;
+	pthread_mutex_lock(&graph.lock);
+
+	for (;;) {
+		if (!graph.queued) {
+			if (!graph.busy)
+				break;
+
+			pthread_cond_wait(&graph.cond, &graph.lock);
+			continue;
+		}
+
+		graph_node *node = graph.queue[--graph.queued];
+		++graph.busy;
+		pthread_mutex_unlock(&graph.lock);
+
+		graph_explore(node);
+
+		pthread_mutex_lock(&graph.lock);
+		--graph.busy;
+	}
+
+	pthread_cond_broadcast(&graph.cond);
+	pthread_mutex_unlock(&graph.lock);
+	return NULL;
+}
+
+/* Explore the prereq graph of target, unless that already happened. */
+static void graph_explore_from(const char *target) {
+	/* the depdb handle isn't shared between threads */
+	if (use_depdb())
+		return;
+
+	/* initialize these before there are threads */
+	run_magic();
+	hash_default();
+
+	char *path = find_dep_path(NULL, target);
+	if (!path || graph_find(path, 'c')) {
+		free(path);
+		return;
+	}
+
+	pthread_mutex_lock(&graph.lock);
+	graph_add(xstrdup(target), path, 'c');
+	pthread_mutex_unlock(&graph.lock);
+
+	graph_worker(NULL);
+
+	/* there must not be any threads left once we fork() */
+	for (size_t i = 0; i < graph.nthreads; ++i)
+		pthread_join(graph.threads[i], NULL);
+	graph.nthreads = 0;
+	jobs_return();
+}
+
+/* Returns 1 if node and all of its prereqs are clean, -1 otherwise. Like
+   check_target(), this doesn't recurse, as chains can be very deep. */
+static int graph_verdict(graph_node *root) {
+	if (root->verdict)
+		return root->verdict;
+
+	size_t depth = 0, size = 16;
+	graph_node **stack = xmalloc(size * sizeof(*stack));
+
+	root->verdict = root->clean ? 2 : -1;
+	if (root->clean)
+		stack[depth++] = root;
+
+	while (depth) {
+		graph_node *node = stack[depth - 1];
+		if (node->next == node->count) {
+			node->verdict = 1;
+			--depth;
+			continue;
+		}
+
+		graph_node *prereq = node->prereqs[node->next];
+		if (prereq->verdict == 1) {
+			++node->next;
+		} else if (prereq->verdict) {
+			/* a prereq isn't clean, or forms a cycle */
+			node->verdict = -1;
+			--depth;
+		} else if (!prereq->clean) {
+			prereq->verdict = -1;
+		} else {
+			/* 2 marks the nodes on the stack */
+			prereq->verdict = 2;
+			if (depth == size)
+				stack = xrealloc(stack, (size *= 2) * sizeof(*stack));
+			stack[depth++] = prereq;
+		}
+	}
+
+	free(stack);
+	return root->verdict;
+}
+
+/* Forget that the target with the record path and everything depending on it
+   were found clean, as it was just built. Other targets stay clean: the .do
+   script only builds prereqs of the target, and those that were clean aren't
+   built again. Targets modified by a .do script as a side effect aren't
+   noticed. */
+static void graph_invalidate(const char *path) {
+	size_t depth = 0, size = 16;
+	graph_node **stack = xmalloc(size * sizeof(*stack));
+
+	for (const char *ident = "ce"; *ident; ++ident) {
+		graph_node *node = graph_find(path, *ident);
+		if (node) {
+			node->clean = false;
+			stack[depth++] = node;
+		}
+	}
+
+	/* a verdict that's still unknown will take the target into account, so
+	   only verdicts already made have to be undone */
+	while (depth) {
+		graph_node *node = stack[--depth];
+		node->verdict = -1;
+
+		for (size_t i = 0; i < node->nparents; ++i) {
+			if (node->parents[i]->verdict != 1)
+				continue;
+
+			node->parents[i]->verdict = -1;
+			if (depth == size)
+				stack = xrealloc(stack, (size *= 2) * sizeof(*stack));
+			stack[depth++] = node->parents[i];
+		}
+	}
+
+	free(stack);
+}
+
+/* Returns true if exploring the graph found dep and all of its prereqs to be
+   clean, and nothing they depend on was built since.
+
+   Only builds of this process are passed to graph_invalidate(), not those of
+   forked jobs or nested redo processes. A verdict that's stale because of them
+   is still safe: a target another process builds through redo-ifchange is out
+   of date, so nothing depending on it was found clean in the first place, and
+   targets depending on redo-always are never clean. Targets that aren't found
+   clean are checked one by one, and begin_check() takes the result of a build
+   by another process from the magic in its record. Only a target created for
+   redo-ifcreate or built by an explicit redo can change behind a clean
+   verdict, which check_target() wouldn't notice either once it's past the
+   target. */
+static bool graph_clean(const dep_info *dep) {
+	graph_node *node = graph_find(dep->path, 'c');
+	return node && graph_verdict(node) > 0;
+}
+
+/* Hash the output of dep, a target built by build_target() without hashing it,
+   and compare it against the hash of the previous build still stored in the
+   record. Returns 0 on success and -1 if the output was removed or modified
+   since it was built, in which case dep is left untouched. */
+static int resolve_pending(dep_info *dep) {
+	int fd = open(dep->target, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			fatal("redo: failed to open %s", dep->target);
+
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st))
+		fatal("redo: failed to stat() %s", dep->target);
+
+	if (dep->ctime.tv_sec != st.st_ctim.tv_sec
+			|| dep->ctime.tv_nsec != st.st_ctim.tv_nsec) {
+		log_info("%s: modified before it was hashed\n", dep->target);
+		close(fd);
+		return -1;
+	}
+
+	unsigned char *old_hash = dep->hash;
+	int old_algo = dep->hash_algo;
+	dep->hash_algo = hash_default();
+	dep->hash = hash_cached(dep->target, fd, &st, dep->hash_algo);
+	close(fd);
+
+	if (old_hash && same_content(dep, old_hash, old_algo))
+		dep->flags &= ~DEP_CHANGED;
+	else
+		dep->flags |= DEP_CHANGED;
+
+	free(old_hash);
+
+	dep->flags &= ~DEP_PENDING;
+	write_dep_information(dep);
+	return 0;
+}
+
+/* Returns the path of the lock held by every job started by
+   settle_detached(). */
+static char *settle_path(void) {
+	return concat(2, getenv("REDO_ROOT"), "/.redo/settle");
+}
+
+/* Hash the output of the target arg, unless whoever needed the hash first was
+   quicker. Holds the lock of the target meanwhile, so that anyone else needing
+   the hash waits for it. */
+static void settle_job(void *arg) {
 	dep_info dep = {
-		.target = target,
-		.path = get_dep_path(target),
+		.target = arg,
+		.path = get_dep_path(NULL, arg),
 	};
 
 	if (!dep.path)
-		return 1;
+		return;
+
+	int lockfd = jobs_parallel() ? lock_target(dep.path) : -1;
+
+	if (!read_dep_information(&dep) && (dep.flags & DEP_PENDING))
+		resolve_pending(&dep);
+
+	if (jobs_parallel())
+		unlock_target(dep.path, lockfd);
 
-	int retval = handle_ident(&dep, ident);
 	free(dep.path);
 	free(dep.hash);
+}
 
-	return retval;
+/* Hash the output of target in a detached job, which outlives the redo that
+   built it, so that neither its caller nor the .do script that called it wait
+   for the hash. Returns false if no job slot is free right now. Until it is
+   done, the job holds a shared lock that settle_wait() waits for. */
+static bool settle_detached(const char *target) {
+	char *path = settle_path();
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		fatal("redo: failed to open %s", path);
+
+	/* flock() locks are shared with the job through the inherited fd */
+	while (flock(fd, LOCK_SH))
+		if (errno != EINTR)
+			fatal("redo: failed to lock %s", path);
+
+	bool started = job_detach(settle_job, (void *) target);
+
+	close(fd);
+	free(path);
+	return started;
+}
+
+/* Wait for all outputs still being hashed by jobs of settle_detached(). Must
+   only be called by the outermost redo, before it exits. */
+void settle_wait(void) {
+	char *path = settle_path();
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			fatal("redo: failed to open %s", path);
+
+		free(path);
+		return;
+	}
+
+	while (flock(fd, LOCK_EX))
+		if (errno != EINTR)
+			fatal("redo: failed to lock %s", path);
+
+	close(fd);
+	free(path);
+}
+
+/* Acquire an exclusive lock for the target with the dependency record dep_path,
+   blocking until any other process holding it is done. The lock is released by
+   unlock_target(). */
+static int lock_target(const char *dep_path) {
+	if (use_depdb()) {
+		depdb_lock(depdb_key(dep_path), true);
+		return -1;
+	}
+
+	char *lock_path = concat(2, dep_path, ".lock");
+
+	int fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		fatal("redo: failed to open %s", lock_path);
+
+	struct flock fl = {
+		.l_type = F_WRLCK,
+		.l_whence = SEEK_SET,
+	};
+
+	while (fcntl(fd, F_SETLKW, &fl) == -1)
+		if (errno != EINTR)
+			fatal("redo: failed to lock %s", lock_path);
+
+	free(lock_path);
+	return fd;
+}
+
+static void unlock_target(const char *dep_path, int fd) {
+	if (use_depdb())
+		depdb_lock(depdb_key(dep_path), false);
+	else if (close(fd))
+		fatal("redo: failed to close lock of %s", dep_path);
 }
 
-static int handle_ident(dep_info *dep, int ident) {
+/* Handle the target according to ident, which must not be 'c'. */
+static int handle_ident(dep_info *dep, int ident, bool defer) {
 	switch(ident) {
 	case 'a':
-		return build_target(dep);
-	case 'e':
-		if (fexists(dep->target))
-			return build_target(dep);
+		return build_target(dep, defer);
+	case 'e': {
+		struct stat st;
+		if (!stat_cached(dep->target, &st))
+			return build_target(dep, defer);
 
 		return 0;
-	case 'c':
-		return handle_c(dep);
+	}
 	default:
 		die("redo: unknown identifier '%c'\n", ident);
 	}
 }
 
-static int handle_c(dep_info *dep) {
-	struct dsv_ctx ctx_dep, ctx_prereq;
-	int retval = 0;
+/* Check the 'c' target of f. Status is the result of reading its dependency
+   record, see read_dep_information(). Returns like begin_check(). */
+static bool handle_c(check_frame *f, int status) {
+	struct dsv_ctx ctx_prereq;
+	dep_info *dep = &f->dep;
+	bool defer = !f->need_result;
+	f->stale = dep->magic != run_magic();
 
 	/* check if the dependency record exists and is valid */
-	FILE *depfd = fopen(dep->path, "rb");
-	if (!depfd) {
-		if (errno == ENOENT) {
-			/* dependency record does not exist */
-			log_warn("%s ood: dependency record doesn't exist\n", dep->target);
-			return build_target(dep);
-		} else {
-			fatal("redo: failed to open %s", dep->path);
-		}
-	}
-
-	dsv_init(&ctx_dep, 4);
-
-	if (dsv_parse_file(&ctx_dep, depfd)) {
-		/* parsing failed */
+	if (status < 0) {
+		log_warn("%s ood: dependency record doesn't exist\n", dep->target);
+		f->retval = build_target(dep, defer);
+		return true;
+	} else if (status > 0) {
 		log_info("%s ood: parsing of dependency file failed\n", dep->target);
-		retval = build_target(dep);
-		goto exit;
+		f->retval = build_target(dep, defer);
+		return true;
+	} else if (dep->hash_algo == HASH_STAT && hash_default() != HASH_STAT) {
+		/* stat fingerprints are only good enough if asked for */
+		log_info("%s ood: recorded without reading its contents\n",
+				dep->target);
+		f->retval = build_target(dep, defer);
+		return true;
 	}
 
-	FILE *targetfd = fopen(dep->target, "rb");
-	if (!targetfd) {
+	struct stat curr_st;
+	if (stat_cached(dep->target, &curr_st)) {
 		if (errno != ENOENT) {
-			fatal("redo: failed to open %s", dep->target);
-		} else if (ctx_dep.fields[3][0] == 's') {
+			fatal("redo: failed to stat() %s", dep->target);
+		} else if (dep->flags & DEP_SOURCE) {
 			/* target is a source and must not be rebuild */
-			retval = 1;
-			goto exit2;
+			f->retval = 1;
 		} else {
 			log_info("%s ood: target file nonexistent\n", dep->target);
-			retval = build_target(dep);
-			goto exit2;
+			f->retval = build_target(dep, defer);
 		}
+		return true;
 	}
 
-	struct stat curr_st;
-	if (sscanf(ctx_dep.fields[1], "%lld.%ld", (long long*)&dep->ctime.tv_sec,
-				&dep->ctime.tv_nsec) < 2) {
-		/* ctime parsing failed */
-		log_info("%s ood: ctime parsing failed\n", dep->target);
-		retval = build_target(dep);
-		goto exit3;
-	}
-
-	if (fstat(fileno(targetfd), &curr_st))
-		fatal("redo: failed to stat() %s", dep->target);
-
-	/* store the hash now, as build_target() will need it for comparison */
-	unsigned char *old_hash = xmalloc(20);
-	hex_to_sha1(ctx_dep.fields[0], old_hash); /* TODO: error checking */
-	dep->hash = old_hash;
-
 	if (dep->ctime.tv_sec != curr_st.st_ctim.tv_sec
 			|| dep->ctime.tv_nsec != curr_st.st_ctim.tv_nsec) {
-		/* ctime doesn't match */
+		/* ctime doesn't match, so check the hash, using the algorithm of the
+		   record */
+		int targetfd = open(dep->target, O_RDONLY | O_CLOEXEC);
+		if (targetfd < 0 || fstat(targetfd, &curr_st))
+			fatal("redo: failed to open %s", dep->target);
+
 		dep->ctime = curr_st.st_ctim;
 
-		/* so check the hash */
-		dep->hash = hash_file(targetfd);
+		unsigned char *old_hash = dep->hash;
+		dep->hash = hash_cached(dep->target, targetfd, &curr_st,
+				dep->hash_algo);
+		close(targetfd);
 
-		if (memcmp(old_hash, dep->hash, 20)) {
+		if (memcmp(old_hash, dep->hash, hash_size(dep->hash_algo))) {
 			/* target hash doesn't match */
 			log_info("%s ood: hashes don't match\n", dep->target);
 			free(old_hash);
-			retval = build_target(dep);
-			goto exit3;
+			f->retval = build_target(dep, defer);
+			return true;
 		}
 		free(old_hash);
 
-		/* update ctime hash */
-		write_dep_information(dep);
+		/* ctime needs to be updated */
+		f->stale = true;
 	}
 
-	/* make sure all prereq dependencies are met */
-	char *prereq_path = concat(2, dep->path, ".prereq");
-	FILE *prereqfd = fopen(prereq_path, "rb");
-	if (!prereqfd) {
-		if (errno != ENOENT)
-			fatal("redo: failed to open %s", prereq_path);
+	/* the prereqs were all found to be clean already */
+	if (graph_clean(dep)) {
+		finish_c(f);
+		return true;
+	}
 
-		/* no .prereq file exists; so we don't do anything */
-		goto exit4;
+	/* make sure all prereq dependencies are met */
+	size_t len, off = 0;
+	char *prereqs = load_entry(arena_concat(&scratch, 2, dep->path, ".prereq"),
+			&len);
+
+	/* no .prereq file exists; so we don't do anything */
+	if (!prereqs) {
+		finish_c(f);
+		return true;
 	}
 
-	dsv_init(&ctx_prereq, 2);
+	/* every prereq is on a line of its own */
+	size_t lines = 1;
+	for (char *nl = prereqs; (nl = memchr(nl, '\n', prereqs + len - nl)); ++nl)
+		++lines;
 
-	while (!dsv_parse_file(&ctx_prereq, prereqfd)) {
-		char *target = make_abs(getenv("REDO_ROOT"), ctx_prereq.fields[1]);
-		int outofdate = update_target(target, ctx_prereq.fields[0][0]);
+	f->targets = arena_alloc(&scratch, lines * sizeof(*f->targets));
+	f->idents = arena_alloc(&scratch, lines);
 
-		free(target);
-		free(ctx_prereq.fields[0]);
-		free(ctx_prereq.fields[1]);
+	char *root = getenv("REDO_ROOT");
+	dsv_init(&ctx_prereq, 2);
 
-		if (outofdate) {
-			log_info("%s ood: subtarget(s) ood\n", dep->target);
-			retval = build_target(dep);
-			break;
-		}
+	while (off < len && !dsv_parse_in_place(&ctx_prereq, prereqs + off,
+				len - off)) {
+		off += ctx_prereq.processed;
+
+		char *name = ctx_prereq.fields[1];
+		f->targets[f->count] = is_absolute(name)
+			? arena_strdup(&scratch, name)
+			: arena_concat(&scratch, 3, root, "/", name);
+		f->idents[f->count++] = ctx_prereq.fields[0][0];
 	}
 
 	dsv_free(&ctx_prereq);
-	fclose(prereqfd);
-exit4:
-	free(prereq_path);
-exit3:
-	fclose(targetfd);
-exit2:
-	for (size_t i = 0; i < ctx_dep.fields_count; ++i)
-		free(ctx_dep.fields[i]);
-exit:
-	dsv_free(&ctx_dep);
-	fclose(depfd);
+	free(prereqs);
+
+	/* checking a prereq starts with stat()ing it, so let the latency of slow
+	   filesystems overlap */
+	stat_prefetch(f->count, (const char **) f->targets);
+
+	/* don't hold the lock while descending, it's taken again by finish_c() */
+	if (f->locked) {
+		unlock_target(dep->path, f->lockfd);
+		f->locked = false;
+	}
+
+	return false;
+}
+
+/* Handle the prereq with ident that the 'c' target of f has on itself. As the
+   lock was dropped while checking its other prereqs, another job might have
+   built the target in the meantime. */
+static int handle_self(check_frame *f, int ident) {
+	dep_info *dep = &f->dep;
+
+	if (jobs_parallel() && !f->locked) {
+		f->lockfd = lock_target(dep->path);
+		f->locked = true;
+	}
+
+	dep_info rebuilt = { .target = dep->target, .path = dep->path };
+	int status = read_dep_information(&rebuilt);
+	if (!status && (rebuilt.flags & DEP_PENDING) && f->need_result)
+		status = resolve_pending(&rebuilt);
+
+	free(rebuilt.hash);
+	if (!status && rebuilt.magic == run_magic()) {
+		f->decided = true;
+		return (rebuilt.flags & DEP_CHANGED) ? 1 : 0;
+	}
+
+	unsigned built = builds;
+	int retval = handle_ident(dep, ident, !f->need_result);
+	f->decided = builds != built;
 	return retval;
 }
+
+/* Decide about the 'c' target of f, once its prereqs were checked. */
+static void finish_c(check_frame *f) {
+	dep_info *dep = &f->dep;
+	bool defer = !f->need_result;
+	bool relocked = false;
+
+	if (jobs_parallel() && !f->locked) {
+		f->lockfd = lock_target(dep->path);
+		f->locked = relocked = true;
+	}
+
+	if (f->retval || relocked || f->decided) {
+		/* the target might have been rebuilt as one of its own prereqs, or
+		   checked by another job while it wasn't locked */
+		dep_info rebuilt = { .target = dep->target, .path = dep->path };
+		int rebuilt_status = read_dep_information(&rebuilt);
+		if (!rebuilt_status && (rebuilt.flags & DEP_PENDING) && !defer)
+			rebuilt_status = resolve_pending(&rebuilt);
+
+		free(rebuilt.hash);
+		if (!rebuilt_status && rebuilt.magic == run_magic()) {
+			f->retval = (rebuilt.flags & DEP_CHANGED) ? 1 : 0;
+			return;
+		}
+	}
+
+	if (f->retval) {
+		f->retval = build_target(dep, defer);
+	} else if (f->stale) {
+		/* remember that the target is up to date for the rest of this run */
+		dep->flags &= ~DEP_CHANGED;
+		dep->magic = run_magic();
+		write_dep_information(dep);
+	}
+}
@@ -13,6 +13,9 @@
 
 extern void add_prereq(const char *target, const char *parent, int ident);
 extern void add_prereq_path(const char *target, const char *parent, int ident);
+extern void add_prereqs_path(int count, const char *targets[],
+		const char *parent, int ident);
 extern int update_target(const char *target, int ident);
+extern void settle_wait(void);
 
 #endif
@@ -0,0 +1,819 @@
+/* depdb.c
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "depdb.h"
+#include "util.h"
+#define _FILENAME "depdb.c"
+#include "dbg.h"
+
+/* The database stores the contents of the dependency store (which otherwise
+   lives in .redo/{abs,rel}/) in a single file, .redo/deps.db. It is a log of
+   entries, each of which replaces, extends or removes the value of a key. An
+   entry extending a value points back to the entry it extends. Every entry is
+   written with a single write() and carries a checksum, so entries that were
+   only partially written, e.g. because of a crash, are detected and discarded.
+
+   The newest entry of every key is found through a hash table kept on disk in
+   .redo/deps.idx, so opening the database costs nothing and a lookup only
+   touches the pages it needs of both files, which are mmap()ed. The index is
+   updated in place by each writer while holding a write lock on the log, and
+   read under a read lock. It's marked dirty for as long as a writer changes it,
+   and rebuilt from the log whenever it's dirty or doesn't match the log, e.g.
+   after a crash. */
+
+#define DB_SIGNATURE "redo-db"
+#define IDX_SIGNATURE "redo-ix"
+#define DB_VERSION 2
+#define DB_BOM 0x01020304
+
+#define IDX_MIN_SLOTS 1024
+
+enum db_op {
+	OP_PUT = 1,
+	OP_APPEND,
+	OP_REMOVE,
+};
+
+struct db_header {
+	char signature[8];
+	uint32_t version;
+	uint32_t bom;
+	uint64_t id; /* shared with the index belonging to the log */
+};
+
+/* followed by the key, the value and padding up to the next 8 byte boundary */
+struct db_entry {
+	uint32_t sum;
+	uint32_t keylen;
+	uint32_t vallen;
+	uint32_t op;
+	uint64_t prev; /* the entry an OP_APPEND extends, 0 if none */
+};
+
+struct idx_header {
+	char signature[8];
+	uint32_t version;
+	uint32_t bom;
+	uint64_t id;
+	uint64_t end;  /* offset in the log up to which entries are indexed */
+	uint64_t size; /* number of slots, always a power of 2 */
+	uint64_t used;
+	uint64_t entries; /* in the log up to end */
+	uint64_t dirty; /* nonzero while a writer changes the index */
+};
+
+/* followed by the slots */
+struct idx_slot {
+	uint64_t hash;
+	uint64_t off; /* of the newest entry of the key, 0 if the slot is free */
+};
+
+static struct {
+	int fd;
+	int idxfd;
+	int lockfd;
+	char *path;
+	char *idx_path;
+	uint64_t id;
+	const char *log; /* mapping of the log */
+	size_t log_len;
+	struct idx_header *idx; /* mapping of the index */
+	size_t idx_len;
+	bool corrupt; /* the index points to something that isn't a valid entry */
+} db = { .fd = -1, .idxfd = -1, .lockfd = -1 };
+
+static uint64_t fnv1a(const void *data, size_t len, uint64_t h) {
+	const unsigned char *p = data;
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ p[i]) * 1099511628211ULL;
+
+	return h;
+}
+
+#define FNV_OFFSET 14695981039346656037ULL
+
+static size_t entry_size(size_t keylen, size_t vallen) {
+	return (sizeof(struct db_entry) + keylen + vallen + 7) & ~(size_t) 7;
+}
+
+/* The checksum covers everything but the checksum itself and the padding. */
+static uint32_t entry_sum(const struct db_entry *e, const char *key,
+		const char *val) {
+	uint64_t h = fnv1a(&e->keylen, sizeof(*e) - sizeof(e->sum), FNV_OFFSET);
+	h = fnv1a(key, e->keylen, h);
+	h = fnv1a(val, e->vallen, h);
+	return (uint32_t) (h ^ (h >> 32));
+}
+
+static struct idx_slot *idx_slots(void) {
+	return (struct idx_slot *) (db.idx + 1);
+}
+
+static size_t idx_len(uint64_t size) {
+	return sizeof(struct idx_header) + size * sizeof(struct idx_slot);
+}
+
+/* Make sure at least the first len bytes of the log are mapped. Returns false
+   if the log is shorter than that. */
+static bool map_log(size_t len) {
+	if (len <= db.log_len)
+		return true;
+
+	struct stat st;
+	if (fstat(db.fd, &st))
+		fatal("redo: failed to stat() %s", db.path);
+	if ((size_t) st.st_size < len)
+		return false;
+
+	if (db.log && munmap((void *) db.log, db.log_len))
+		fatal("redo: failed to munmap() %s", db.path);
+
+	db.log = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, db.fd, 0);
+	if (db.log == MAP_FAILED)
+		fatal("redo: failed to mmap() %s", db.path);
+
+	db.log_len = st.st_size;
+	return true;
+}
+
+static void unmap_index(void) {
+	if (db.idx && munmap(db.idx, db.idx_len))
+		fatal("redo: failed to munmap() %s", db.idx_path);
+
+	db.idx = NULL;
+	db.idx_len = 0;
+}
+
+/* Map the index as far as its header says it goes, remapping it if another
+   process resized it. Must be called with the log locked, as only the header
+   may be touched before. */
+static void map_index(void) {
+	if (db.idx && db.idx_len == idx_len(db.idx->size))
+		return;
+
+	unmap_index();
+
+	struct stat st;
+	if (fstat(db.idxfd, &st))
+		fatal("redo: failed to stat() %s", db.idx_path);
+	if ((size_t) st.st_size < sizeof(struct idx_header))
+		return;
+
+	db.idx = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			db.idxfd, 0);
+	if (db.idx == MAP_FAILED)
+		fatal("redo: failed to mmap() %s", db.idx_path);
+	db.idx_len = st.st_size;
+}
+
+/* Returns true if the index belongs to the log and looks sane. */
+static bool index_valid(void) {
+	map_index();
+	if (!db.idx || db.corrupt)
+		return false;
+
+	struct idx_header *h = db.idx;
+	return !memcmp(h->signature, IDX_SIGNATURE, sizeof(IDX_SIGNATURE))
+		&& h->version == DB_VERSION && h->bom == DB_BOM && h->id == db.id
+		&& h->size >= IDX_MIN_SLOTS && !(h->size & (h->size - 1))
+		&& h->used < h->size && db.idx_len == idx_len(h->size)
+		&& !h->dirty && h->end >= sizeof(struct db_header)
+		&& map_log(h->end);
+}
+
+/* Read the entry at off, which must end before end. Returns false if there is
+   no intact entry. */
+static bool read_entry(uint64_t off, uint64_t end, struct db_entry *e,
+		const char **key, const char **val) {
+	if (off < sizeof(struct db_header) || off % 8 || end < off
+			|| end - off < sizeof(*e) || !map_log(end))
+		return false;
+
+	memcpy(e, db.log + off, sizeof(*e));
+	if (e->op < OP_PUT || e->op > OP_REMOVE
+			|| entry_size(e->keylen, e->vallen) > end - off)
+		return false;
+
+	*key = db.log + off + sizeof(*e);
+	*val = *key + e->keylen;
+	return entry_sum(e, *key, *val) == e->sum;
+}
+
+/* Returns the slot of key, or the free slot it would go into. */
+static struct idx_slot *lookup(const char *key, size_t keylen, uint64_t h) {
+	struct idx_slot *slots = idx_slots();
+	uint64_t mask = db.idx->size - 1;
+
+	for (uint64_t n = 0, i = h & mask; n <= mask; ++n, i = (i + 1) & mask) {
+		if (!slots[i].off)
+			return &slots[i];
+		if (slots[i].hash != h)
+			continue;
+
+		struct db_entry e;
+		const char *k, *v;
+		if (!read_entry(slots[i].off, db.idx->end, &e, &k, &v)) {
+			db.corrupt = true;
+			return NULL;
+		}
+
+		if (e.keylen == keylen && !memcmp(k, key, keylen))
+			return &slots[i];
+	}
+
+	/* there is always a free slot */
+	db.corrupt = true;
+	return NULL;
+}
+
+/* Reassemble the value whose newest entry is at off. Returns NULL if the key
+   was removed, or if the index is corrupt, in which case db.corrupt is set. */
+static char *read_value(uint64_t off, size_t *len) {
+	uint64_t *chain = NULL;
+	size_t count = 0, alloc = 0;
+	size_t total = 0;
+	char *val = NULL;
+
+	while (off) {
+		struct db_entry e;
+		const char *k, *v;
+		if (!read_entry(off, db.idx->end, &e, &k, &v) || e.prev >= off) {
+			db.corrupt = true;
+			goto out;
+		}
+
+		if (e.op == OP_REMOVE)
+			break;
+
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 8;
+			chain = chain ? xrealloc(chain, alloc * sizeof(*chain))
+			              : xmalloc(alloc * sizeof(*chain));
+		}
+
+		chain[count++] = off;
+		total += e.vallen;
+		off = e.op == OP_APPEND ? e.prev : 0;
+	}
+
+	if (!count)
+		goto out;
+
+	val = xmalloc(total + 1);
+	*len = 0;
+	while (count--) {
+		struct db_entry e;
+		const char *k, *v;
+		read_entry(chain[count], db.idx->end, &e, &k, &v);
+		memcpy(val + *len, v, e.vallen);
+		*len += e.vallen;
+	}
+	val[*len] = '\0';
+
+out:
+	free(chain);
+	return val;
+}
+
+static void lock_range(int fd, short type, off_t start, const char *path) {
+	struct flock fl = {
+		.l_type = type,
+		.l_whence = SEEK_SET,
+		.l_start = start,
+		.l_len = 1,
+	};
+
+	while (fcntl(fd, F_SETLKW, &fl) == -1)
+		if (errno != EINTR)
+			fatal("redo: failed to lock %s", path);
+}
+
+static void lock_log(short type) {
+	lock_range(db.fd, type, 0, db.path);
+}
+
+/* The byte of .redo/deps.lock locked for reading by every process that has
+   the database open, see depdb_compact(). It lies past all the locks of
+   depdb_lock(). */
+static off_t open_lock_offset(void) {
+	return sizeof(off_t) > 4 ? (off_t) 1 << 40 : (off_t) 1 << 30;
+}
+
+/* Replace the index with an empty one of size slots. Must be called with the
+   log locked for writing. */
+static void reset_index(uint64_t size) {
+	unmap_index();
+	if (ftruncate(db.idxfd, 0) || ftruncate(db.idxfd, idx_len(size)))
+		fatal("redo: failed to truncate %s", db.idx_path);
+
+	map_index();
+
+	struct idx_header *h = db.idx;
+	memcpy(h->signature, IDX_SIGNATURE, sizeof(IDX_SIGNATURE));
+	h->version = DB_VERSION;
+	h->bom = DB_BOM;
+	h->id = db.id;
+	h->end = sizeof(struct db_header);
+	h->size = size;
+	h->used = 0;
+	h->entries = 0;
+	h->dirty = 1;
+	db.corrupt = false;
+}
+
+/* Point the slot of key to the entry at off. */
+static void index_entry(const char *key, size_t keylen, uint64_t off) {
+	/* keep the load factor below 0.7 */
+	if ((db.idx->used + 1) * 10 >= db.idx->size * 7) {
+		uint64_t size = db.idx->size;
+		struct idx_slot *old = xmalloc(size * sizeof(*old));
+		memcpy(old, idx_slots(), size * sizeof(*old));
+
+		uint64_t end = db.idx->end, entries = db.idx->entries;
+		reset_index(size * 2);
+		db.idx->end = end;
+		db.idx->entries = entries;
+
+		struct idx_slot *slots = idx_slots();
+		uint64_t mask = db.idx->size - 1;
+		for (uint64_t i = 0; i < size; ++i) {
+			if (!old[i].off)
+				continue;
+
+			uint64_t j = old[i].hash & mask;
+			while (slots[j].off)
+				j = (j + 1) & mask;
+			slots[j] = old[i];
+			++db.idx->used;
+		}
+
+		free(old);
+	}
+
+	uint64_t h = fnv1a(key, keylen, FNV_OFFSET);
+	struct idx_slot *slot = lookup(key, keylen, h);
+	if (!slot)
+		die("redo: %s is corrupt\n", db.path);
+
+	if (!slot->off)
+		++db.idx->used;
+	slot->hash = h;
+	slot->off = off;
+}
+
+/* Index the intact entries of the log past the end of the index, and cut off
+   whatever follows them, which is a leftover of a crash. Must be called with
+   the log locked for writing. */
+static void index_tail(void) {
+	struct stat st;
+	if (fstat(db.fd, &st))
+		fatal("redo: failed to stat() %s", db.path);
+
+	uint64_t off = db.idx->end;
+	struct db_entry e;
+	const char *key, *val;
+	while (read_entry(off, st.st_size, &e, &key, &val)) {
+		index_entry(key, e.keylen, off);
+		off += entry_size(e.keylen, e.vallen);
+		db.idx->end = off;
+		++db.idx->entries;
+	}
+
+	if ((uint64_t) st.st_size > off) {
+		if (ftruncate(db.fd, off))
+			fatal("redo: failed to truncate %s", db.path);
+
+		/* don't keep a mapping past the end of the file */
+		if (db.log && munmap((void *) db.log, db.log_len))
+			fatal("redo: failed to munmap() %s", db.path);
+		db.log = NULL;
+		db.log_len = 0;
+	}
+}
+
+/* Lock the log for writing and bring the index up to date with it. The index
+   stays dirty until end_write(). */
+static void begin_write(void) {
+	lock_log(F_WRLCK);
+
+	if (index_valid())
+		db.idx->dirty = 1;
+	else
+		reset_index(IDX_MIN_SLOTS);
+
+	index_tail();
+}
+
+/* Mark the index as consistent again, and change the lock of the log to
+   type. */
+static void end_write(short type) {
+	db.idx->dirty = 0;
+	lock_log(type);
+}
+
+/* Lock the log for reading, making sure the index can be used. */
+static void begin_read(void) {
+	lock_log(F_RDLCK);
+	if (index_valid())
+		return;
+
+	lock_log(F_UNLCK);
+	begin_write();
+	end_write(F_RDLCK);
+}
+
+static void write_entry(enum db_op op, const char *key, const char *val,
+		size_t vallen) {
+	assert(db.fd >= 0);
+	size_t keylen = strlen(key);
+	size_t size = entry_size(keylen, vallen);
+	char *buf = xmalloc(size);
+
+	begin_write();
+
+	struct db_entry e = {
+		.keylen = keylen,
+		.vallen = vallen,
+		.op = op,
+	};
+
+	uint64_t h = fnv1a(key, keylen, FNV_OFFSET);
+	struct idx_slot *slot = lookup(key, keylen, h);
+	if (!slot) {
+		reset_index(IDX_MIN_SLOTS);
+		index_tail();
+		if (!(slot = lookup(key, keylen, h)))
+			die("redo: %s is corrupt\n", db.path);
+	}
+
+	if (op == OP_APPEND && slot->off) {
+		struct db_entry prev;
+		const char *k, *v;
+		read_entry(slot->off, db.idx->end, &prev, &k, &v);
+		if (prev.op != OP_REMOVE)
+			e.prev = slot->off;
+	}
+
+	e.sum = entry_sum(&e, key, val);
+
+	memset(buf, 0, size);
+	memcpy(buf, &e, sizeof(e));
+	memcpy(buf + sizeof(e), key, keylen);
+	if (vallen)
+		memcpy(buf + sizeof(e) + keylen, val, vallen);
+
+	uint64_t off = db.idx->end;
+	if (pwrite(db.fd, buf, size, off) != (ssize_t) size)
+		fatal("redo: failed to write to %s", db.path);
+
+	index_entry(key, keylen, off);
+	db.idx->end = off + size;
+	++db.idx->entries;
+
+	end_write(F_UNLCK);
+	free(buf);
+}
+
+static void close_files(void) {
+	if (db.log && munmap((void *) db.log, db.log_len))
+		fatal("redo: failed to munmap() %s", db.path);
+	unmap_index();
+	db.log = NULL;
+	db.log_len = 0;
+
+	if (db.fd >= 0)
+		close(db.fd);
+	if (db.idxfd >= 0)
+		close(db.idxfd);
+	db.fd = db.idxfd = -1;
+}
+
+/* Open the log and the index. Returns false if there is no log. */
+static bool open_files(void) {
+	db.fd = open(db.path, O_RDWR | O_CLOEXEC);
+	if (db.fd < 0) {
+		if (errno == ENOENT)
+			return false;
+		fatal("redo: failed to open %s", db.path);
+	}
+
+	struct db_header hdr;
+	if (pread(db.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+			|| memcmp(hdr.signature, DB_SIGNATURE, sizeof(DB_SIGNATURE))
+			|| hdr.version != DB_VERSION || hdr.bom != DB_BOM)
+		die("redo: %s is not a compatible dependency database\n", db.path);
+	db.id = hdr.id;
+
+	db.idxfd = open(db.idx_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (db.idxfd < 0)
+		fatal("redo: failed to open %s", db.idx_path);
+
+	return true;
+}
+
+/* Open the dependency database of root, if one exists. */
+bool depdb_open(const char *root) {
+	if (db.fd >= 0)
+		return true;
+
+	db.path = concat(2, root, "/.redo/deps.db");
+	db.idx_path = concat(2, root, "/.redo/deps.idx");
+	if (access(db.path, F_OK)) {
+		free(db.path);
+		free(db.idx_path);
+		db.path = db.idx_path = NULL;
+		return false;
+	}
+
+	char *lock_path = concat(2, root, "/.redo/deps.lock");
+	db.lockfd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (db.lockfd < 0)
+		fatal("redo: failed to open %s", lock_path);
+
+	/* waits for a depdb_compact() in progress */
+	lock_range(db.lockfd, F_RDLCK, open_lock_offset(), lock_path);
+	free(lock_path);
+
+	if (!open_files())
+		die("redo: %s vanished\n", db.path);
+
+	return true;
+}
+
+/* Returns a copy of the value stored under key, or NULL if there is none. */
+char *depdb_get(const char *key, size_t *len) {
+	size_t keylen = strlen(key);
+	uint64_t h = fnv1a(key, keylen, FNV_OFFSET);
+	char *val = NULL;
+
+	/* if the index turns out to be corrupt, it's rebuilt and tried again */
+	for (int tries = 0; tries < 2; ++tries) {
+		begin_read();
+		struct idx_slot *slot = lookup(key, keylen, h);
+		if (slot && slot->off)
+			val = read_value(slot->off, len);
+		lock_log(F_UNLCK);
+
+		if (!db.corrupt)
+			return val;
+
+		free(val);
+		val = NULL;
+	}
+
+	die("redo: %s is corrupt\n", db.path);
+}
+
+void depdb_put(const char *key, const char *val, size_t len) {
+	write_entry(OP_PUT, key, val, len);
+}
+
+void depdb_append(const char *key, const char *val, size_t len) {
+	write_entry(OP_APPEND, key, val, len);
+}
+
+void depdb_remove(const char *key) {
+	size_t len;
+	char *val = depdb_get(key, &len);
+
+	/* don't bloat the log with entries that don't change anything */
+	if (val)
+		write_entry(OP_REMOVE, key, "", 0);
+	free(val);
+}
+
+/* Acquire or release the lock of key. Locks are byte range locks on
+   .redo/deps.lock at an offset given by the hash of the key. */
+void depdb_lock(const char *key, bool lock) {
+	uint64_t range = sizeof(off_t) > 4 ? 1ULL << 40 : 1ULL << 30;
+	struct flock fl = {
+		.l_type = lock ? F_WRLCK : F_UNLCK,
+		.l_whence = SEEK_SET,
+		.l_start = (off_t) (fnv1a(key, strlen(key), FNV_OFFSET) % range),
+		.l_len = 1,
+	};
+
+	while (fcntl(db.lockfd, lock ? F_SETLKW : F_SETLK, &fl) == -1)
+		if (errno != EINTR)
+			fatal("redo: failed to lock %s", key);
+}
+
+/* Returns a new id for a log, so that its index can be told apart from the
+   index of an older log. */
+static uint64_t new_id(void) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_REALTIME, &ts))
+		fatal("redo: failed to get the current time");
+
+	return ((uint64_t) ts.tv_sec << 32) ^ (uint64_t) ts.tv_nsec
+		^ ((uint64_t) getpid() << 16);
+}
+
+static void write_header(FILE *fp, uint64_t id) {
+	struct db_header hdr = { .version = DB_VERSION, .bom = DB_BOM, .id = id };
+	memcpy(hdr.signature, DB_SIGNATURE, sizeof(DB_SIGNATURE));
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+}
+
+/* Write a fresh copy of the log without superseded entries, if there are
+   more of those than there are keys. Other processes don't expect the log to be replaced,
+   so this is only done if no other process has the database open, which is
+   checked with the lock every one of them holds. */
+void depdb_compact(void) {
+	struct flock fl = {
+		.l_type = F_WRLCK,
+		.l_whence = SEEK_SET,
+		.l_start = open_lock_offset(),
+		.l_len = 1,
+	};
+
+	/* the database is in use by another redo */
+	if (fcntl(db.lockfd, F_SETLK, &fl) == -1)
+		return;
+
+	begin_write();
+
+	/* every key takes up one entry once compacted */
+	if (db.idx->entries < 2 * db.idx->used + 256) {
+		end_write(F_UNLCK);
+		goto out;
+	}
+
+	struct idx_slot *slots = idx_slots();
+	char *tmp_path = concat(2, db.path, ".tmp");
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		fatal("redo: failed to open %s", tmp_path);
+
+	FILE *fp = fdopen(fd, "wb");
+	if (!fp)
+		fatal("redo: failed to fdopen() %s", tmp_path);
+
+	write_header(fp, new_id());
+
+	for (uint64_t i = 0; i < db.idx->size; ++i) {
+		if (!slots[i].off)
+			continue;
+
+		size_t len;
+		char *val = read_value(slots[i].off, &len);
+		if (!val)
+			continue;
+
+		struct db_entry e;
+		const char *key, *v;
+		read_entry(slots[i].off, db.idx->end, &e, &key, &v);
+
+		struct db_entry out = {
+			.keylen = e.keylen,
+			.vallen = len,
+			.op = OP_PUT,
+		};
+		out.sum = entry_sum(&out, key, val);
+
+		static const char pad[8];
+		fwrite(&out, sizeof(out), 1, fp);
+		fwrite(key, 1, out.keylen, fp);
+		fwrite(val, 1, len, fp);
+		fwrite(pad, 1, entry_size(out.keylen, len) - sizeof(out)
+				- out.keylen - len, fp);
+		free(val);
+	}
+
+	/* better keep the old log than lose records */
+	if (db.corrupt) {
+		fclose(fp);
+		unlink(tmp_path);
+		free(tmp_path);
+		end_write(F_UNLCK);
+		goto out;
+	}
+
+	if (fflush(fp) || ferror(fp) || fsync(fd))
+		fatal("redo: failed to write to %s", tmp_path);
+
+	if (rename(tmp_path, db.path))
+		fatal("redo: failed to rename %s to %s", tmp_path, db.path);
+
+	if (fclose(fp))
+		fatal("redo: failed to write to %s", tmp_path);
+	free(tmp_path);
+
+	/* this also releases our lock on the old log */
+	close_files();
+	if (!open_files())
+		die("redo: %s vanished\n", db.path);
+
+	/* nobody else can be using the index now */
+	begin_write();
+	end_write(F_UNLCK);
+
+out:
+	fl.l_type = F_RDLCK;
+	while (fcntl(db.lockfd, F_SETLKW, &fl) == -1)
+		if (errno != EINTR)
+			fatal("redo: failed to lock %s", db.path);
+}
+
+static const char *migrate_root;
+
+static int migrate_file(const char *path, const struct stat *st, int flag,
+		struct FTW *ftw) {
+	UNUSED(ftw);
+
+	if (flag == FTW_DP) {
+		if (rmdir(path))
+			fatal("redo: failed to remove %s", path);
+		return 0;
+	}
+
+	size_t len = strlen(path);
+	if (flag != FTW_F || (len > 5 && !strcmp(path + len - 5, ".lock"))) {
+		if (flag == FTW_F && remove(path))
+			fatal("redo: failed to remove %s", path);
+		return 0;
+	}
+
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		fatal("redo: failed to open %s", path);
+
+	size_t size = st->st_size, read = 0;
+	char *buf = xmalloc(size + 1);
+	if (size)
+		read = fread(buf, 1, size, fp);
+
+	if (read != size || fclose(fp))
+		fatal("redo: failed to read from %s", path);
+
+	depdb_put(path + strlen(migrate_root), buf, size);
+	free(buf);
+
+	if (remove(path))
+		fatal("redo: failed to remove %s", path);
+
+	return 0;
+}
+
+/* Create the dependency database of root and move all dependency records
+   stored as separate files into it. Does nothing if it already exists. */
+void depdb_create(const char *root) {
+	if (depdb_open(root))
+		return;
+
+	char *redodir = concat(2, root, "/.redo");
+	if (mkdir(redodir, 0755) && errno != EEXIST)
+		fatal("redo: failed to mkdir() %s", redodir);
+
+	char *path = concat(2, root, "/.redo/deps.db");
+	char *tmp_path = concat(2, path, ".tmp");
+
+	FILE *fp = fopen(tmp_path, "wb");
+	if (!fp)
+		fatal("redo: failed to open %s", tmp_path);
+
+	write_header(fp, new_id());
+	bool failed = ferror(fp);
+	if (fclose(fp) || failed)
+		fatal("redo: failed to write to %s", tmp_path);
+
+	if (rename(tmp_path, path))
+		fatal("redo: failed to rename %s to %s", tmp_path, path);
+
+	if (!depdb_open(root))
+		die("redo: failed to create %s\n", path);
+
+	/* keys are relative to .redo/, e.g. "rel/out/redo.o.prereq" */
+	char *dirs[] = { "/abs", "/rel" };
+	migrate_root = concat(2, redodir, "/");
+	for (size_t i = 0; i < sizeof(dirs)/sizeof(dirs[0]); ++i) {
+		char *dir = concat(2, redodir, dirs[i]);
+		if (nftw(dir, migrate_file, 16, FTW_DEPTH | FTW_PHYS) && errno != ENOENT)
+			fatal("redo: failed to migrate %s", dir);
+		free(dir);
+	}
+
+	free((char*) migrate_root);
+	free(tmp_path);
+	free(path);
+	free(redodir);
+}
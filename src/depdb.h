@@ -0,0 +1,24 @@
+/* depdb.h
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __RDEPDB_H__
+#define __RDEPDB_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+extern bool depdb_open(const char *root);
+extern void depdb_create(const char *root);
+extern void depdb_compact(void);
+extern char *depdb_get(const char *key, size_t *len);
+extern void depdb_put(const char *key, const char *val, size_t len);
+extern void depdb_append(const char *key, const char *val, size_t len);
+extern void depdb_remove(const char *key);
+extern void depdb_lock(const char *key, bool lock);
+
+#endif
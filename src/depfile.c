@@ -0,0 +1,123 @@
+/* depfile.c
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "depfile.h"
+#include "util.h"
+#define _FILENAME "depfile.c"
+#include "dbg.h"
+
+/* Compilers write the headers a file includes as a Makefile rule, like
+   `foo.o: foo.c foo.h \` followed by more prerequisites on the next line.
+   Only the prerequisites are of interest; the targets, and rules without
+   prerequisites such as the ones written by -MP, are ignored. Spaces in names
+   are escaped as "\ ", '#' as "\#" and '$' as "$$". */
+
+struct name_list {
+	char **names;
+	size_t count, size;
+};
+
+static void add_name(struct name_list *list, const char *name, size_t len) {
+	if (list->count == list->size) {
+		list->size = list->size ? list->size * 2 : 64;
+		list->names = list->names
+			? xrealloc(list->names, list->size * sizeof(*list->names))
+			: xmalloc(list->size * sizeof(*list->names));
+	}
+
+	char *copy = xmalloc(len + 1);
+	memcpy(copy, name, len);
+	copy[len] = '\0';
+	list->names[list->count++] = copy;
+}
+
+static char *read_file(const char *path, size_t *len) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		fatal("redo: failed to open %s", path);
+
+	size_t size = 4096;
+	char *buf = xmalloc(size);
+	ssize_t r;
+
+	*len = 0;
+	while ((r = read(fd, buf + *len, size - *len))) {
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("redo: failed to read from %s", path);
+		}
+
+		*len += r;
+		if (*len == size)
+			buf = xrealloc(buf, size *= 2);
+	}
+
+	close(fd);
+	return buf;
+}
+
+/* Return the prerequisites of all rules in the depfile at path, and store
+   their number in count. */
+char **depfile_read(const char *path, size_t *count) {
+	size_t len;
+	char *buf = read_file(path, &len);
+
+	struct name_list list = {0};
+	char *name = xmalloc(len + 1);
+	size_t name_len = 0;
+	bool prereqs = false;
+
+	for (size_t i = 0; i <= len; ++i) {
+		char c = i < len ? buf[i] : '\n';
+		char next = i + 1 < len ? buf[i + 1] : '\n';
+
+		if (c == '\\' && (next == ' ' || next == '#')) {
+			name[name_len++] = next;
+			++i;
+		} else if (c == '\\' && (next == '\n' || next == '\r')) {
+			/* the rule continues on the next line */
+			i += next == '\r' && i + 2 < len && buf[i + 2] == '\n' ? 2 : 1;
+			c = ' ';
+		} else if (c == '$' && next == '$') {
+			name[name_len++] = '$';
+			++i;
+		} else if (c == ':' && !prereqs && (next == ' ' || next == '\t'
+					|| next == '\n' || next == '\r')) {
+			/* everything so far were targets */
+			prereqs = true;
+			name_len = 0;
+			continue;
+		} else if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+			name[name_len++] = c;
+		}
+
+		if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+			if (name_len && prereqs)
+				add_name(&list, name, name_len);
+
+			name_len = 0;
+			if (c == '\n')
+				prereqs = false;
+		}
+	}
+
+	free(name);
+	free(buf);
+
+	*count = list.count;
+	return list.names;
+}
@@ -0,0 +1,16 @@
+/* depfile.h
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __RDEPFILE_H__
+#define __RDEPFILE_H__
+
+#include <stddef.h>
+
+extern char **depfile_read(const char *path, size_t *count);
+
+#endif
@@ -0,0 +1,224 @@
+/* dircache.c
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dircache.h"
+#include "util.h"
+#define _FILENAME "dircache.c"
+#include "dbg.h"
+
+/* Finding the .do script of a target means probing for several names in the
+   directory of the target and in each of its parents. Instead of one access()
+   per name, each directory is read once and the names of the .do scripts in it
+   are kept. Scripts are created by .do scripts, including those run by nested
+   redo processes, which are done by the time the build that started them is.
+   So after every build, dir_refresh() makes the first lookup in a directory
+   compare its inode and timestamps with the ones it had when it was read, and
+   read it again if they differ. A directory modified within the granularity
+   of its timestamps might change again without them changing, so until that's
+   no longer the case, a name missing from its listing is looked up with
+   access(). A directory that doesn't exist is remembered as having none. */
+
+/* a listing is racy if its directory was modified less than this many seconds
+   before it was read */
+#define RACY_SECONDS 2
+
+struct dir_listing {
+	char *dir;
+	uint64_t hash;
+	char **names; /* sorted */
+	size_t count;
+	bool exists;
+	bool racy;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	struct timespec ctime;
+	unsigned generation; /* of the last check, see dir_refresh() */
+};
+
+static struct {
+	struct dir_listing *slots;
+	size_t size; /* always a power of 2 */
+	size_t used;
+	unsigned generation;
+} cache;
+
+static uint64_t fnv1a(const char *s) {
+	uint64_t h = 14695981039346656037ULL;
+	while (*s)
+		h = (h ^ (unsigned char) *s++) * 1099511628211ULL;
+
+	return h;
+}
+
+/* Return the slot of dir, or the empty slot where it belongs. */
+static struct dir_listing *find_slot(const char *dir, uint64_t hash) {
+	for (size_t i = hash & (cache.size - 1);; i = (i + 1) & (cache.size - 1)) {
+		struct dir_listing *slot = &cache.slots[i];
+		if (!slot->dir || (slot->hash == hash && !strcmp(slot->dir, dir)))
+			return slot;
+	}
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static bool same_time(const struct timespec *a, const struct timespec *b) {
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/* Returns true if st describes the directory as it was when listing was read. */
+static bool unchanged(const struct dir_listing *listing, const struct stat *st) {
+	return listing->dev == st->st_dev && listing->ino == st->st_ino
+		&& same_time(&listing->mtime, &st->st_mtim)
+		&& same_time(&listing->ctime, &st->st_ctim);
+}
+
+static bool is_racy(const struct stat *st) {
+	return time(NULL) - st->st_mtim.tv_sec < RACY_SECONDS;
+}
+
+static void free_names(struct dir_listing *listing) {
+	for (size_t i = 0; i < listing->count; ++i)
+		free(listing->names[i]);
+
+	free(listing->names);
+	listing->names = NULL;
+	listing->count = 0;
+}
+
+/* Read the names of all .do scripts in dir into listing. */
+static void read_listing(struct dir_listing *listing) {
+	free_names(listing);
+	listing->exists = false;
+	listing->racy = false;
+	listing->generation = cache.generation;
+
+	DIR *dp = opendir(listing->dir);
+	if (!dp) {
+		if (errno != ENOENT && errno != ENOTDIR)
+			fatal("redo: failed to open directory %s", listing->dir);
+
+		return;
+	}
+
+	/* the timestamps are taken first, so that any later change is noticed */
+	struct stat st;
+	if (fstat(dirfd(dp), &st))
+		fatal("redo: failed to stat() %s", listing->dir);
+
+	listing->exists = true;
+	listing->racy = is_racy(&st);
+	listing->dev = st.st_dev;
+	listing->ino = st.st_ino;
+	listing->mtime = st.st_mtim;
+	listing->ctime = st.st_ctim;
+
+	size_t size = 0;
+	struct dirent *entry;
+	while ((errno = 0, entry = readdir(dp))) {
+		size_t len = strlen(entry->d_name);
+		if (len < 3 || strcmp(entry->d_name + len - 3, ".do"))
+			continue;
+
+		if (listing->count == size) {
+			size = size ? size * 2 : 16;
+			listing->names = listing->names
+				? xrealloc(listing->names, size * sizeof(*listing->names))
+				: xmalloc(size * sizeof(*listing->names));
+		}
+
+		listing->names[listing->count++] = xstrdup(entry->d_name);
+	}
+
+	if (errno)
+		fatal("redo: failed to read directory %s", listing->dir);
+
+	closedir(dp);
+	qsort(listing->names, listing->count, sizeof(*listing->names),
+			compare_names);
+}
+
+static void grow(void) {
+	struct dir_listing *old = cache.slots;
+	size_t old_size = cache.size;
+
+	cache.size = old_size ? old_size * 2 : 64;
+	cache.slots = xmalloc(cache.size * sizeof(*cache.slots));
+	memset(cache.slots, 0, cache.size * sizeof(*cache.slots));
+
+	for (size_t i = 0; i < old_size; ++i)
+		if (old[i].dir)
+			*find_slot(old[i].dir, old[i].hash) = old[i];
+
+	free(old);
+}
+
+/* Read the listing again if its directory changed since it was read. */
+static void check_listing(struct dir_listing *listing) {
+	listing->generation = cache.generation;
+
+	struct stat st;
+	if (stat(listing->dir, &st)) {
+		if (errno != ENOENT && errno != ENOTDIR)
+			fatal("redo: failed to stat() %s", listing->dir);
+
+		if (listing->exists)
+			read_listing(listing);
+		return;
+	}
+
+	if (!listing->exists || !unchanged(listing, &st)
+			|| (listing->racy && !is_racy(&st)))
+		read_listing(listing);
+}
+
+/* Returns true if the .do script name exists in dir. */
+bool dir_has_doscript(const char *dir, const char *name) {
+	if ((cache.used + 1) * 2 > cache.size)
+		grow();
+
+	uint64_t hash = fnv1a(dir);
+	struct dir_listing *listing = find_slot(dir, hash);
+	if (!listing->dir) {
+		*listing = (struct dir_listing) { .dir = xstrdup(dir), .hash = hash };
+		++cache.used;
+		read_listing(listing);
+	} else if (listing->generation != cache.generation) {
+		check_listing(listing);
+	}
+
+	if (listing->count && bsearch(&name, listing->names, listing->count,
+				sizeof(*listing->names), compare_names))
+		return true;
+
+	if (!listing->racy)
+		return false;
+
+	char *path = concat(3, dir, "/", name);
+	bool found = !access(path, F_OK);
+	free(path);
+	return found;
+}
+
+/* Make the next lookup in each directory check whether it changed. */
+void dir_refresh(void) {
+	++cache.generation;
+}
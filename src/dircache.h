@@ -0,0 +1,17 @@
+/* dircache.h
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __RDIRCACHE_H__
+#define __RDIRCACHE_H__
+
+#include <stdbool.h>
+
+extern bool dir_has_doscript(const char *dir, const char *name);
+extern void dir_refresh(void);
+
+#endif
@@ -23,7 +23,8 @@ bool is_absolute(const char* path) {
 }
 
 /* Returns a new copy of str with the extension removed, where the extension is
-   everything behind the last dot, including the dot. */
+   everything behind the last dot of the last path component, including the
+   dot. */
 char *remove_ext(const char *str) {
 	assert(str);
 	size_t len;
@@ -32,6 +33,8 @@ char *remove_ext(const char *str) {
 	for (len = 0; str[len]; ++len)
 		if (str[len] == '.')
 			dot = (char*) &str[len];
+		else if (str[len] == '/')
+			dot = NULL;
 
 	if (dot) /* recalculate length to only reach just before the last dot */
 		len = dot - str;
@@ -0,0 +1,308 @@
+/* gitindex.c
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "gitindex.h"
+#include "util.h"
+#include "filepath.h"
+#define _FILENAME "gitindex.c"
+#include "dbg.h"
+
+/* Git keeps the stat data of every tracked file in .git/index next to the id
+   of its blob. As long as the stat data still matches, git considers the file
+   unchanged, and so can we: its blob id is its HASH_GITBLOB hash. The index is
+   read once per process, the first time it's needed, see
+   https://git-scm.com/docs/index-format for the format. */
+
+#define INDEX_SIGNATURE "DIRC"
+
+/* offsets into an index entry, all fields are 32 bit big endian */
+enum {
+	E_CTIME_SEC = 0,
+	E_CTIME_NSEC = 4,
+	E_MTIME_SEC = 8,
+	E_MTIME_NSEC = 12,
+	E_DEV = 16,
+	E_INO = 20,
+	E_MODE = 24,
+	E_UID = 28,
+	E_GID = 32,
+	E_SIZE = 36,
+	E_OID = 40,
+	E_FLAGS = 60, /* 16 bit */
+	E_PATH = 62,
+};
+
+#define FLAG_ASSUME_VALID 0x8000
+#define FLAG_EXTENDED 0x4000
+#define FLAG_STAGE 0x3000
+#define XFLAG_SKIP_WORKTREE 0x4000
+#define XFLAG_INTENT_TO_ADD 0x2000
+
+struct index_entry {
+	char *path;
+	const unsigned char *data;
+};
+
+static struct {
+	bool loaded;
+	char *root;  /* worktree, with a trailing '/' */
+	unsigned char *buf;
+	struct timespec mtime;
+	struct index_entry *entries;
+	size_t count;
+} idx;
+
+static uint32_t get_be32(const unsigned char *p) {
+	return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint16_t get_be16(const unsigned char *p) {
+	return p[0] << 8 | p[1];
+}
+
+/* Returns true if git was asked to use its index by --git-index. */
+bool git_index_enabled(void) {
+	char *env = getenv("REDO_GIT_INDEX");
+	return env && *env && strcmp(env, "0");
+}
+
+/* Returns the path of the index of the worktree root, which is either in the
+   .git directory or in the directory a .git file points to. */
+static char *index_path(const char *root) {
+	char *dotgit = concat(2, root, ".git");
+	struct stat st;
+	if (stat(dotgit, &st)) {
+		free(dotgit);
+		return NULL;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		char *path = concat(2, dotgit, "/index");
+		free(dotgit);
+		return path;
+	}
+
+	FILE *fp = fopen(dotgit, "r");
+	free(dotgit);
+	if (!fp)
+		return NULL;
+
+	char line[4096];
+	char *gitdir = NULL;
+	if (fgets(line, sizeof(line), fp) && !strncmp(line, "gitdir: ", 8)) {
+		line[strcspn(line, "\n")] = '\0';
+		gitdir = make_abs((char *) root, line + 8);
+	}
+	fclose(fp);
+
+	if (!gitdir)
+		return NULL;
+
+	char *path = concat(2, gitdir, "/index");
+	free(gitdir);
+	return path;
+}
+
+/* Find the worktree containing REDO_ROOT and read its index. Returns false if
+   there is none or it couldn't be parsed. */
+static bool load_index(void) {
+	char *dir = realpath(getenv("REDO_ROOT"), NULL);
+	if (!dir)
+		return false;
+
+	char *path = NULL;
+	for (;;) {
+		idx.root = concat(2, dir, dir[1] ? "/" : "");
+		if ((path = index_path(idx.root)))
+			break;
+
+		free(idx.root);
+		idx.root = NULL;
+
+		char *slash = strrchr(dir, '/');
+		if (slash == dir && !dir[1])
+			break;
+		slash[slash == dir] = '\0';
+	}
+	free(dir);
+
+	if (!path)
+		return false;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < 12) {
+		close(fd);
+		return false;
+	}
+
+	idx.mtime = st.st_mtim;
+	idx.buf = xmalloc(st.st_size);
+
+	size_t len = 0;
+	ssize_t r;
+	while (len < (size_t) st.st_size
+			&& (r = read(fd, idx.buf + len, st.st_size - len))) {
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("redo: failed to read the git index");
+		}
+		len += r;
+	}
+	close(fd);
+
+	uint32_t version = get_be32(idx.buf + 4);
+	if (len < 12 || memcmp(idx.buf, INDEX_SIGNATURE, 4)
+			|| version < 2 || version > 4)
+		return false;
+
+	uint32_t count = get_be32(idx.buf + 8);
+	idx.entries = xmalloc((count + 1) * sizeof(*idx.entries));
+
+	const unsigned char *p = idx.buf + 12, *end = idx.buf + len;
+	char *prev = xstrdup("");
+	for (uint32_t i = 0; i < count; ++i) {
+		if (end - p < E_PATH + 2)
+			goto corrupt;
+
+		uint16_t flags = get_be16(p + E_FLAGS), xflags = 0;
+		size_t path_off = E_PATH;
+		if (version >= 3 && (flags & FLAG_EXTENDED)) {
+			xflags = get_be16(p + E_PATH);
+			path_off += 2;
+		}
+
+		const unsigned char *name = p + path_off;
+		char *path;
+		size_t entry_len;
+
+		if (version < 4) {
+			const unsigned char *nul = memchr(name, '\0', end - name);
+			if (!nul)
+				goto corrupt;
+
+			path = xstrdup((const char *) name);
+			entry_len = (path_off + (nul - name) + 8) & ~7;
+		} else {
+			/* the path is stored as the number of bytes to remove from the
+			   previous one, followed by the bytes to append */
+			const unsigned char *q = name;
+			uintmax_t strip = *q & 127;
+			while (*q & 128 && ++q < end)
+				strip = ((strip + 1) << 7) | (*q & 127);
+			if (++q >= end)
+				goto corrupt;
+
+			const unsigned char *nul = memchr(q, '\0', end - q);
+			if (!nul || strip > strlen(prev))
+				goto corrupt;
+
+			size_t keep = strlen(prev) - strip;
+			path = xmalloc(keep + (nul - q) + 1);
+			memcpy(path, prev, keep);
+			strcpy(path + keep, (const char *) q);
+			entry_len = (nul + 1) - p;
+		}
+
+		free(prev);
+		prev = xstrdup(path);
+
+		if ((size_t) (end - p) < entry_len)
+			goto corrupt;
+
+		/* only use entries git itself trusts its stat data for */
+		if (flags & (FLAG_ASSUME_VALID | FLAG_STAGE)
+				|| xflags & (XFLAG_SKIP_WORKTREE | XFLAG_INTENT_TO_ADD))
+			free(path);
+		else
+			idx.entries[idx.count++] = (struct index_entry) { path, p };
+
+		p += entry_len;
+	}
+
+	free(prev);
+	return true;
+
+corrupt:
+	free(prev);
+	log_err("redo: ignoring corrupt git index\n");
+	idx.count = 0;
+	return false;
+}
+
+static int compare_entries(const void *a, const void *b) {
+	return strcmp(((const struct index_entry *) a)->path,
+			((const struct index_entry *) b)->path);
+}
+
+/* Look up the file at path with the metadata st in the git index. If git
+   considers it unchanged, its blob id is stored in oid and true is returned. */
+bool git_index_lookup(const char *path, const struct stat *st,
+		unsigned char *oid) {
+	if (!idx.loaded) {
+		idx.loaded = true;
+		load_index();
+	}
+
+	if (!idx.count || !S_ISREG(st->st_mode))
+		return false;
+
+	char *abspath = realpath(path, NULL);
+	if (!abspath)
+		return false;
+
+	size_t rootlen = strlen(idx.root);
+	struct index_entry *e = NULL;
+	if (!strncmp(abspath, idx.root, rootlen)) {
+		struct index_entry key = { .path = abspath + rootlen };
+		e = bsearch(&key, idx.entries, idx.count, sizeof(key),
+				compare_entries);
+	}
+	free(abspath);
+
+	if (!e)
+		return false;
+
+	const unsigned char *d = e->data;
+	if ((get_be32(d + E_MODE) & S_IFMT) != S_IFREG
+			|| get_be32(d + E_CTIME_SEC) != (uint32_t) st->st_ctim.tv_sec
+			|| get_be32(d + E_CTIME_NSEC) != (uint32_t) st->st_ctim.tv_nsec
+			|| get_be32(d + E_MTIME_SEC) != (uint32_t) st->st_mtim.tv_sec
+			|| get_be32(d + E_MTIME_NSEC) != (uint32_t) st->st_mtim.tv_nsec
+			|| get_be32(d + E_DEV) != (uint32_t) st->st_dev
+			|| get_be32(d + E_INO) != (uint32_t) st->st_ino
+			|| get_be32(d + E_UID) != (uint32_t) st->st_uid
+			|| get_be32(d + E_GID) != (uint32_t) st->st_gid
+			|| get_be32(d + E_SIZE) != (uint32_t) st->st_size)
+		return false;
+
+	/* if the file was modified in the same instant the index was written,
+	   the stat data might match even though the contents differ */
+	if (st->st_mtim.tv_sec > idx.mtime.tv_sec
+			|| (st->st_mtim.tv_sec == idx.mtime.tv_sec
+			    && st->st_mtim.tv_nsec >= idx.mtime.tv_nsec))
+		return false;
+
+	memcpy(oid, d + E_OID, GIT_OID_SIZE);
+	return true;
+}
@@ -0,0 +1,21 @@
+/* gitindex.h
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __RGITINDEX_H__
+#define __RGITINDEX_H__
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#define GIT_OID_SIZE 20
+
+extern bool git_index_enabled(void);
+extern bool git_index_lookup(const char *path, const struct stat *st,
+		unsigned char *oid);
+
+#endif
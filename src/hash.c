@@ -0,0 +1,331 @@
+/* hash.c
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE /* MAP_ANONYMOUS */
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+#include "jobs.h"
+#include "util.h"
+#define _FILENAME "hash.c"
+#include "dbg.h"
+
+/* size (64 bit), mtime (64 bit seconds, 32 bit nanoseconds), inode (64 bit) */
+#define HASH_STAT_SIZE 28
+
+static const struct {
+	const char *name;
+	size_t size;
+} algos[HASH_ALGO_COUNT] = {
+	[HASH_SHA1]   = { "sha1",   SHA1_DIGEST_SIZE },
+	[HASH_BLAKE3] = { "blake3", BLAKE3_DIGEST_SIZE },
+	[HASH_GITBLOB] = { "gitblob", SHA1_DIGEST_SIZE },
+	[HASH_STAT]    = { "stat",    HASH_STAT_SIZE },
+};
+
+void hash_init(hash_ctx *ctx, int algo) {
+	ctx->algo = algo;
+
+	switch (algo) {
+	case HASH_SHA1:
+	case HASH_GITBLOB:
+		SHA1_Init(&ctx->u.sha1);
+		break;
+	case HASH_BLAKE3:
+		BLAKE3_Init(&ctx->u.blake3);
+		break;
+	default:
+		assert(!"unknown hash algorithm");
+	}
+}
+
+void hash_update(hash_ctx *ctx, const void *data, size_t len) {
+	if (ctx->algo == HASH_BLAKE3)
+		BLAKE3_Update(&ctx->u.blake3, data, len);
+	else
+		SHA1_Update(&ctx->u.sha1, data, len);
+}
+
+void hash_final(hash_ctx *ctx, unsigned char *digest) {
+	if (ctx->algo == HASH_BLAKE3)
+		BLAKE3_Final(digest, &ctx->u.blake3);
+	else
+		SHA1_Final(digest, &ctx->u.sha1);
+}
+
+/* Like hash_init(), for hashing a file of size bytes. Git blob ids start with
+   a header containing the size. */
+static void hash_start(hash_ctx *ctx, int algo, off_t size) {
+	hash_init(ctx, algo);
+
+	if (algo == HASH_GITBLOB) {
+		char header[32];
+		int len = snprintf(header, sizeof(header), "blob %jd", (intmax_t) size);
+		hash_update(ctx, header, len + 1);
+	}
+}
+
+/* Returns the size of the digests produced by algo in bytes. */
+size_t hash_size(int algo) {
+	return algos[algo].size;
+}
+
+/* Returns the algorithm called name, or -1 if there is no such algorithm. */
+int hash_lookup(const char *name) {
+	for (int i = 0; i < HASH_ALGO_COUNT; ++i)
+		if (!strcmp(algos[i].name, name))
+			return i;
+
+	return -1;
+}
+
+/* Returns the algorithm used for new dependency records, which is taken from
+   REDO_HASH. */
+int hash_default(void) {
+	static int algo = -1;
+	if (algo < 0) {
+		char *name = getenv("REDO_HASH");
+		if (!name || !*name)
+			algo = HASH_SHA1;
+		else if ((algo = hash_lookup(name)) < 0)
+			die("redo: unknown hash algorithm %s\n", name);
+	}
+
+	return algo;
+}
+
+/* Hash everything that can be read from fd with algo, returning a pointer to
+   the heap allocated hash. */
+unsigned char *hash_read(int fd, int algo) {
+	if (algo == HASH_STAT)
+		return hash_stat(fd);
+
+	unsigned char *hash = xmalloc(hash_size(algo));
+	unsigned char data[HASH_READ_SIZE] __attribute__((aligned(4096)));
+	hash_ctx context;
+	ssize_t r;
+
+	/* only git blob ids need the size up front */
+	struct stat st = {0};
+	if (algo == HASH_GITBLOB && fstat(fd, &st))
+		fatal("redo: failed to stat() data");
+
+	hash_start(&context, algo, st.st_size);
+	while ((r = read(fd, data, sizeof(data)))) {
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("redo: failed to read data");
+		}
+
+		hash_update(&context, data, r);
+	}
+	hash_final(&context, hash);
+
+	return hash;
+}
+
+/* The mapping hash_map() is hashing right now. If the file is truncated in the
+   meantime, touching the pages past its new end raises SIGBUS, possibly in one
+   of the threads of BLAKE3_UpdateParallel(). The handler then maps zeros over
+   the rest of the mapping so that hashing can go on, and hash_map() throws the
+   result away and reads the file instead. */
+static char *volatile map_start;
+static volatile size_t map_len;
+static volatile sig_atomic_t map_truncated;
+static size_t page_size;
+
+static void sigbus_handler(int sig, siginfo_t *info, void *context) {
+	(void) context;
+	char *addr = info->si_addr;
+
+	if (map_start && addr >= map_start && addr < map_start + map_len) {
+		char *page = addr - (uintptr_t) addr % page_size;
+		if (mmap(page, map_start + map_len - page, PROT_READ,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+			map_truncated = 1;
+			return;
+		}
+	}
+
+	/* not ours, so fault again without the handler */
+	signal(sig, SIG_DFL);
+}
+
+static void install_sigbus_handler(void) {
+	static bool installed;
+	if (installed)
+		return;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	struct sigaction sa = {
+		.sa_sigaction = sigbus_handler,
+		.sa_flags = SA_SIGINFO,
+	};
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGBUS, &sa, NULL))
+		fatal("redo: failed to install SIGBUS handler");
+	installed = true;
+}
+
+/* Like hash_read(), but hashes the first size bytes of fd through a mapping,
+   which saves copying the data. Falls back to hash_read() if fd can't be
+   mapped or is truncated while it's being hashed. */
+unsigned char *hash_map(int fd, off_t size, int algo) {
+	if (size <= 0 || (uintmax_t) size > SIZE_MAX || algo == HASH_STAT)
+		return hash_read(fd, algo);
+
+	install_sigbus_handler();
+
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return hash_read(fd, algo);
+
+	map_truncated = 0;
+	map_len = size;
+	map_start = map;
+
+	posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+
+	unsigned char *hash = xmalloc(hash_size(algo));
+	hash_ctx context;
+
+	hash_start(&context, algo, size);
+	if (algo == HASH_BLAKE3 && size >= HASH_PARALLEL_MIN) {
+		/* use the cores that no other job is using right now */
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		unsigned threads = 1 + jobs_borrow(cpus - 1);
+
+		BLAKE3_UpdateParallel(&context.u.blake3, map, size, threads);
+		jobs_return();
+	} else {
+		hash_update(&context, map, size);
+	}
+	hash_final(&context, hash);
+
+	map_start = NULL;
+	if (munmap(map, size))
+		fatal("redo: failed to unmap data");
+
+	if (map_truncated) {
+		free(hash);
+		if (lseek(fd, 0, SEEK_SET))
+			fatal("redo: failed to seek in data");
+
+		return hash_read(fd, algo);
+	}
+
+	return hash;
+}
+
+/* Hash the file fd, which is size bytes long, with algo, returning a pointer to
+   the heap allocated hash. Large files are mapped, everything else is read in
+   large chunks. */
+unsigned char *hash_file(int fd, off_t size, int algo) {
+	if (size >= HASH_MAP_MIN)
+		return hash_map(fd, size, algo);
+
+	return hash_read(fd, algo);
+}
+
+static unsigned char *put_be(unsigned char *p, uint64_t value, int bytes) {
+	while (bytes--)
+		*p++ = value >> 8*bytes;
+
+	return p;
+}
+
+/* Returns the HASH_STAT fingerprint of fd, which only changes along with its
+   size, mtime or inode. This trusts everything that modifies a file to also
+   change one of those, which is only the case on some filesystems. */
+unsigned char *hash_stat(int fd) {
+	struct stat st;
+	if (fstat(fd, &st))
+		fatal("redo: failed to stat() data");
+
+	unsigned char *hash = xmalloc(HASH_STAT_SIZE);
+	unsigned char *p = put_be(hash, st.st_size, 8);
+	p = put_be(p, st.st_mtim.tv_sec, 8);
+	p = put_be(p, st.st_mtim.tv_nsec, 4);
+	put_be(p, st.st_ino, 8);
+
+	return hash;
+}
+
+/* Write the hash field of a dependency record to buf, which needs room for
+   HASH_FIELD_MAX+1 bytes, and return its length. SHA-1 digests are stored as
+   plain hex like in previous versions, all others are prefixed with the name
+   of their algorithm and a '-'. */
+size_t hash_format(int algo, const unsigned char *digest, char *buf) {
+	static const char hex[] = "0123456789abcdef";
+	char *pos = buf;
+
+	if (algo != HASH_SHA1) {
+		pos = stpcpy(pos, algos[algo].name);
+		*pos++ = '-';
+	}
+
+	for (size_t i = 0; i < hash_size(algo); ++i) {
+		*pos++ = hex[digest[i] >> 4];
+		*pos++ = hex[digest[i] & 0xf];
+	}
+
+	*pos = '\0';
+	return pos - buf;
+}
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+
+	return -1;
+}
+
+/* Parse a hash field written by hash_format() into digest, which needs room for
+   HASH_MAX_SIZE bytes. Returns the algorithm or -1 if s is malformed. */
+int hash_parse(const char *s, unsigned char *digest) {
+	int algo = HASH_SHA1;
+
+	const char *sep = strchr(s, '-');
+	if (sep) {
+		for (algo = 0; algo < HASH_ALGO_COUNT; ++algo)
+			if (strlen(algos[algo].name) == (size_t) (sep - s)
+					&& !strncmp(algos[algo].name, s, sep - s))
+				break;
+
+		if (algo == HASH_SHA1 || algo == HASH_ALGO_COUNT)
+			return -1;
+
+		s = sep + 1;
+	}
+
+	if (strlen(s) != 2*hash_size(algo))
+		return -1;
+
+	for (size_t i = 0; i < hash_size(algo); ++i) {
+		int hi = hex_value(s[2*i]), lo = hex_value(s[2*i+1]);
+		if (hi < 0 || lo < 0)
+			return -1;
+
+		digest[i] = hi << 4 | lo;
+	}
+
+	return algo;
+}
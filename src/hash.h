@@ -0,0 +1,66 @@
+/* hash.h
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __RHASH_H__
+#define __RHASH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "sha1.h"
+#include "blake3.h"
+
+enum hash_algo {
+	HASH_SHA1,
+	HASH_BLAKE3,
+	HASH_GITBLOB, /* SHA-1 of "blob <size>\0" and the contents, like git */
+	HASH_STAT,    /* size, mtime and inode, the contents aren't read at all */
+	HASH_ALGO_COUNT,
+};
+
+#define HASH_MAX_SIZE BLAKE3_DIGEST_SIZE
+/* size of the reads done by hash_read() */
+#define HASH_READ_SIZE (128 * 1024)
+/* files of at least this size are hashed by hash_map() */
+#define HASH_MAP_MIN (1024 * 1024)
+/* files of at least this size are hashed by multiple threads, if the algorithm
+   supports it */
+#define HASH_PARALLEL_MIN (16 * 1024 * 1024)
+/* hashes of files of at least this size are cached by inode. The dependency
+   record of a file already keeps its hash until its ctime changes, so the cache
+   only helps if the same version is hashed again under another name, while
+   each new version costs a new entry. For smaller files that entry costs more
+   than hashing them again whenever needed. */
+#define HASH_CACHE_MIN (64 * 1024)
+
+/* longest hash field in a dependency record, excluding the null byte */
+#define HASH_FIELD_MAX (16 + 2*HASH_MAX_SIZE)
+
+typedef struct hash_ctx {
+	int algo;
+	union {
+		SHA_CTX sha1;
+		BLAKE3_CTX blake3;
+	} u;
+} hash_ctx;
+
+extern void hash_init(hash_ctx *ctx, int algo);
+extern void hash_update(hash_ctx *ctx, const void *data, size_t len);
+extern void hash_final(hash_ctx *ctx, unsigned char *digest);
+extern size_t hash_size(int algo);
+extern int hash_lookup(const char *name);
+extern int hash_default(void);
+extern unsigned char *hash_read(int fd, int algo);
+extern unsigned char *hash_map(int fd, off_t size, int algo);
+extern unsigned char *hash_file(int fd, off_t size, int algo);
+extern unsigned char *hash_stat(int fd);
+extern size_t hash_format(int algo, const unsigned char *digest, char *buf);
+extern int hash_parse(const char *s, unsigned char *digest);
+
+#endif
@@ -0,0 +1,147 @@
+/* hashbench.c
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+/* Compares the throughput of the SHA-1 implementations available on this
+   machine, and of the other hash algorithms, after checking that all SHA-1
+   implementations agree. Build and run it with `redo bench`.
+
+   If files are given instead, it compares hash_read() and hash_map() on each
+   of them, with the file in the page cache (warm) and evicted from it (cold).
+   The algorithm is taken from REDO_HASH and all cores may be used. */
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+#include "jobs.h"
+#include "util.h"
+#define _FILENAME "hashbench.c"
+#include "dbg.h"
+
+int DBG_LVL;
+
+static const char *sha1_impls[] = { "generic", "x86-sha", "armv8-crypto" };
+
+static double now(void) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		fatal("hashbench: failed to get the current time");
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Hash size bytes of data with algo in chunks of chunk bytes, repeatedly for
+   at least a quarter of a second, and return the throughput in MB/s. */
+static double bench(int algo, const unsigned char *data, size_t size,
+		size_t chunk, unsigned char *digest) {
+	size_t rounds = 0;
+	double start = now(), elapsed;
+
+	do {
+		hash_ctx ctx;
+		hash_init(&ctx, algo);
+		for (size_t off = 0; off < size; off += chunk)
+			hash_update(&ctx, data + off, size - off < chunk ? size - off : chunk);
+		hash_final(&ctx, digest);
+		++rounds;
+	} while ((elapsed = now() - start) < 0.25);
+
+	return (double) size * rounds / elapsed / 1e6;
+}
+
+/* Hash the file at path with hash_map() if map is true, hash_read()
+   otherwise, and return the throughput in MB/s. If cold is true, the file is
+   dropped from the page cache first. */
+static double bench_file(const char *path, bool map, bool cold) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		fatal("hashbench: failed to open %s", path);
+
+	struct stat st;
+	if (fstat(fd, &st))
+		fatal("hashbench: failed to stat() %s", path);
+
+	if (cold && (fdatasync(fd) || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED)))
+		fatal("hashbench: failed to evict %s from the page cache", path);
+
+	double start = now();
+	free(map ? hash_map(fd, st.st_size, hash_default())
+			: hash_read(fd, hash_default()));
+	double elapsed = now() - start;
+
+	close(fd);
+	return st.st_size / elapsed / 1e6;
+}
+
+static void bench_files(int count, char *paths[]) {
+	printf("%-30s %10s %10s %10s %10s\n", "file", "read cold", "map cold",
+			"read warm", "map warm");
+
+	for (int i = 0; i < count; ++i) {
+		double read_cold = bench_file(paths[i], false, true);
+		double map_cold = bench_file(paths[i], true, true);
+		bench_file(paths[i], false, false);
+		double read_warm = bench_file(paths[i], false, false);
+		double map_warm = bench_file(paths[i], true, false);
+
+		printf("%-30s %5.0f MB/s %5.0f MB/s %5.0f MB/s %5.0f MB/s\n", paths[i],
+				read_cold, map_cold, read_warm, map_warm);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	if (argc > 1) {
+		jobs_init(0);
+		bench_files(argc - 1, &argv[1]);
+		return 0;
+	}
+
+	size_t size = 64 << 20;
+
+	unsigned char *data = xmalloc(size);
+	for (size_t i = 0; i < size; ++i)
+		data[i] = i * 2654435761u >> 24;
+
+	unsigned char expected[HASH_MAX_SIZE], digest[HASH_MAX_SIZE];
+	bool have_expected = false;
+	int failed = 0;
+
+	printf("%-20s %12s %12s\n", "implementation", "8 KiB reads", "one buffer");
+	for (size_t i = 0; i < sizeof(sha1_impls) / sizeof(sha1_impls[0]); ++i) {
+		if (SHA1_SelectImplementation(sha1_impls[i]))
+			continue;
+
+		double chunked = bench(HASH_SHA1, data, size, 8192, digest);
+		double whole = bench(HASH_SHA1, data, size, size, digest);
+
+		if (!have_expected) {
+			memcpy(expected, digest, SHA1_DIGEST_SIZE);
+			have_expected = true;
+		} else if (memcmp(expected, digest, SHA1_DIGEST_SIZE)) {
+			printf("sha1 %-15s produced a wrong digest\n", sha1_impls[i]);
+			failed = 1;
+			continue;
+		}
+
+		printf("sha1 %-15s %7.0f MB/s %7.0f MB/s\n", sha1_impls[i], chunked,
+				whole);
+	}
+
+	printf("%-20s %7.0f MB/s %7.0f MB/s\n", "blake3",
+			bench(HASH_BLAKE3, data, size, 8192, digest),
+			bench(HASH_BLAKE3, data, size, size, digest));
+
+	free(data);
+	return failed;
+}
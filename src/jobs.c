@@ -0,0 +1,435 @@
+/* jobs.c
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "jobs.h"
+#include "util.h"
+#define _FILENAME "jobs.c"
+#include "dbg.h"
+
+/* Upper limit for the number of tokens put into the jobserver pipe, this keeps
+   us well below the pipe capacity so that writing them never blocks. */
+#define JOBS_MAX 4096
+
+/* The job limit is implemented by a GNU make compatible jobserver: every process
+   owns one implicit job slot and has to take a token out of the pipe for every
+   additional job it wants to run in parallel. Tokens are put back as soon as
+   the job finishes, so the limit is shared by the whole invocation tree,
+   including any make processes started by .do scripts. */
+static long maxjobs = 1; /* 0 means unlimited */
+static int js_read = -1, js_write = -1;
+
+static size_t running; /* jobs started by this process */
+static size_t tokens;  /* tokens taken out of the pipe */
+static int failed;
+
+/* A non-blocking reopen of js_read and the tokens taken through it, see
+   jobs_borrow(). */
+static int borrow_fd = -1;
+static long borrowed;
+
+/* A dup() of js_read which is closed by the SIGCHLD handler, so that a blocking
+   read() on it returns as soon as one of our jobs terminates. */
+static volatile sig_atomic_t token_fd = -1;
+static bool handler_installed;
+
+static void sigchld_handler(int sig) {
+	UNUSED(sig);
+	int saved_errno = errno;
+	int fd = token_fd;
+	if (fd >= 0) {
+		token_fd = -1;
+		close(fd);
+	}
+	errno = saved_errno;
+}
+
+static void release_token(void) {
+	assert(tokens);
+	if (write(js_write, "+", 1) != 1)
+		fatal("redo: failed to write to jobserver");
+	--tokens;
+}
+
+/* Replace all job related flags in MAKEFLAGS with flags, so that sub-makes (and
+   everything else understanding the jobserver protocol) share our job slots. */
+static void export_makeflags(const char *flags) {
+	char *env = getenv("MAKEFLAGS");
+	char *old = xstrdup(env ? env : "");
+	char *new = xmalloc(strlen(old) + strlen(flags) + 2);
+	char *p = new;
+
+	for (char *word = strtok(old, " "); word; word = strtok(NULL, " ")) {
+		if (!strncmp(word, "-j", 2) || !strncmp(word, "--jobserver-auth=", 17)
+				|| !strncmp(word, "--jobserver-fds=", 16))
+			continue;
+
+		p += sprintf(p, "%s%s", p == new ? "" : " ", word);
+	}
+
+	if (*flags)
+		sprintf(p, "%s%s", p == new ? "" : " ", flags);
+	else
+		*p = '\0';
+
+	if (setenv("MAKEFLAGS", new, 1))
+		fatal("redo: failed to setenv() MAKEFLAGS to %s", new);
+
+	free(old);
+	free(new);
+}
+
+/* Create a new jobserver allowing maxjobs jobs to run in parallel and export it
+   to our children. A value of 0 lifts the limit entirely. */
+void jobs_init(long n) {
+	char buf[64];
+
+	if (n > JOBS_MAX) {
+		log_warn("redo: limiting jobs to %d\n", JOBS_MAX);
+		n = JOBS_MAX;
+	}
+	maxjobs = n;
+
+	if (maxjobs > 1) {
+		int fds[2];
+		if (pipe(fds))
+			fatal("redo: failed to create jobserver pipe");
+
+		js_read = fds[0];
+		js_write = fds[1];
+
+		for (long i = 1; i < maxjobs; ++i)
+			if (write(js_write, "+", 1) != 1)
+				fatal("redo: failed to write to jobserver");
+
+		sprintf(buf, "-j%ld --jobserver-auth=%d,%d", maxjobs, js_read, js_write);
+		export_makeflags(buf);
+	} else {
+		export_makeflags(maxjobs ? "" : "-j");
+	}
+
+	sprintf(buf, "%ld", maxjobs);
+	if (setenv("REDO_JOBS", buf, 1))
+		fatal("redo: failed to setenv() REDO_JOBS to %s", buf);
+}
+
+/* Look for a jobserver in MAKEFLAGS and open it. Both the classic "R,W" pipe
+   form and the named pipe form "fifo:PATH" used by newer makes are understood.
+   Returns false if MAKEFLAGS contains no usable jobserver. */
+static bool open_makeflags_jobserver(bool *unlimited) {
+	char *env = getenv("MAKEFLAGS");
+	*unlimited = false;
+	if (!env)
+		return false;
+
+	char *flags = xstrdup(env);
+	char *auth = NULL;
+
+	for (char *word = strtok(flags, " "); word; word = strtok(NULL, " ")) {
+		if (!strncmp(word, "--jobserver-auth=", 17))
+			auth = word + 17;
+		else if (!strncmp(word, "--jobserver-fds=", 16))
+			auth = word + 16;
+		else if (!strcmp(word, "-j"))
+			*unlimited = true;
+	}
+
+	bool ret = false;
+	if (!auth) {
+		/* nothing to do */
+	} else if (!strncmp(auth, "fifo:", 5)) {
+		js_read = js_write = open(auth + 5, O_RDWR);
+		if (js_read >= 0) {
+			fcntl(js_read, F_SETFD, FD_CLOEXEC);
+			ret = true;
+		}
+	} else if (sscanf(auth, "%d,%d", &js_read, &js_write) == 2
+			&& fcntl(js_read, F_GETFD) != -1
+			&& fcntl(js_write, F_GETFD) != -1) {
+		ret = true;
+	}
+
+	if (auth && !ret) {
+		/* the fds were closed somewhere along the way */
+		debug("jobserver %s unavailable\n", auth);
+		js_read = js_write = -1;
+	}
+
+	free(flags);
+	return ret;
+}
+
+/* Use the jobserver of a parent redo or make process, if there is one. Returns
+   false if we aren't running under either of them. */
+bool jobs_attach(void) {
+	char *env = getenv("REDO_JOBS");
+	bool unlimited;
+
+	if (env) {
+		maxjobs = atol(env);
+		if (maxjobs > 1 && !open_makeflags_jobserver(&unlimited))
+			maxjobs = 1; /* fall back to serial mode */
+
+		return true;
+	}
+
+	if (open_makeflags_jobserver(&unlimited)) {
+		/* the size of the pool is only known to make */
+		maxjobs = JOBS_MAX;
+		return true;
+	}
+
+	if (unlimited) {
+		maxjobs = 0;
+		return true;
+	}
+
+	return false;
+}
+
+/* Returns true if other jobs may be running at the same time as we are. */
+bool jobs_parallel(void) {
+	return maxjobs != 1;
+}
+
+/* Collect terminated jobs and give back the tokens that aren't needed anymore.
+   If block is set, wait for at least one job to finish. Returns the number of
+   jobs collected. */
+static size_t reap(bool block) {
+	size_t n = 0;
+	int status;
+	pid_t pid;
+
+	while (running) {
+		pid = waitpid(-1, &status, (block && !n) ? 0 : WNOHANG);
+		if (!pid)
+			break;
+
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+			fatal("redo: waitpid() failed");
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			++failed;
+
+		--running;
+		++n;
+
+		/* keep one token less than jobs running, the implicit slot */
+		while (tokens && tokens >= running)
+			release_token();
+	}
+
+	return n;
+}
+
+/* Block until we are allowed to start another job. */
+static void acquire_slot(void) {
+	while (maxjobs && running >= 1 + tokens) {
+		/* the order matters here: if a job terminates after reap() but before
+		   read(), the handler closes token_fd and read() fails with EBADF */
+		if (token_fd < 0) {
+			token_fd = fcntl(js_read, F_DUPFD_CLOEXEC, 0);
+			if (token_fd < 0)
+				fatal("redo: failed to dup() jobserver fd");
+		}
+
+		if (reap(false))
+			continue;
+
+		char c;
+		ssize_t r = read(token_fd, &c, 1);
+		if (r == 1) {
+			++tokens;
+		} else if (!r) {
+			die("redo: jobserver pipe closed unexpectedly\n");
+		} else if (errno != EINTR && errno != EBADF) {
+			fatal("redo: failed to read from jobserver");
+		}
+	}
+}
+
+/* Take a token out of the pipe if one is available right away. Returns false
+   otherwise. */
+static bool try_token(void) {
+	if (js_read < 0)
+		return false;
+
+	/* the jobserver is shared with other processes, so it can't be switched
+	   to non-blocking mode; opening it again gives us a separate file
+	   description instead, which only works on Linux */
+	if (borrow_fd < 0) {
+		char path[64];
+		sprintf(path, "/proc/self/fd/%d", js_read);
+		borrow_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (borrow_fd < 0)
+			return false;
+	}
+
+	char c;
+	return read(borrow_fd, &c, 1) == 1;
+}
+
+/* Run fn(arg) as a new job, as soon as a job slot is available. Without
+   parallelism, fn() is simply called directly. Jobs terminating with a nonzero
+   exit status are counted as failed and no new jobs are started after that. */
+void job_start(job_fn fn, void *arg) {
+	if (maxjobs == 1) {
+		fn(arg);
+		return;
+	}
+
+	if (!handler_installed) {
+		struct sigaction sa = {
+			.sa_handler = sigchld_handler,
+			.sa_flags = SA_RESTART | SA_NOCLDSTOP,
+		};
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(SIGCHLD, &sa, NULL))
+			fatal("redo: failed to install SIGCHLD handler");
+		handler_installed = true;
+	}
+
+	reap(false);
+	if (failed)
+		return;
+
+	acquire_slot();
+
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid == -1) {
+		fatal("redo: failed to fork() new process");
+	} else if (pid == 0) {
+		/* child: owns exactly the slot we acquired for it */
+		signal(SIGCHLD, SIG_DFL);
+		handler_installed = false;
+		if (token_fd >= 0) {
+			close(token_fd);
+			token_fd = -1;
+		}
+		running = tokens = 0;
+
+		fn(arg);
+		exit(EXIT_SUCCESS);
+	}
+
+	++running;
+}
+
+/* Give back the slot of a detached job, which happens on exit, so that it isn't
+   lost if the job dies. */
+static void return_detached_slot(void) {
+	if (write(js_write, "+", 1) != 1)
+		log_err("redo: failed to write to jobserver: %s\n", strerror(errno));
+}
+
+/* Run fn(arg) in a process of its own that nobody waits for, if a job slot is
+   available right away. The process gives the slot back once it exits, so it
+   may outlive us. Returns false without calling fn() if there is no free slot
+   or no parallelism. */
+bool job_detach(job_fn fn, void *arg) {
+	if (maxjobs == 1 || (maxjobs && !try_token()))
+		return false;
+
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid == -1) {
+		fatal("redo: failed to fork() new process");
+	} else if (pid == 0) {
+		/* fork again, so that the job is adopted by init instead of being
+		   collected by a waitpid() meant for our jobs */
+		pid = fork();
+		if (pid)
+			_exit(pid == -1);
+
+		signal(SIGCHLD, SIG_DFL);
+		handler_installed = false;
+		if (token_fd >= 0) {
+			close(token_fd);
+			token_fd = -1;
+		}
+		running = tokens = borrowed = 0;
+
+		if (maxjobs && atexit(return_detached_slot)) {
+			return_detached_slot();
+			_exit(EXIT_FAILURE);
+		}
+
+		/* don't keep anyone waiting for the end of our output */
+		int null = open("/dev/null", O_RDWR);
+		if (null < 0 || dup2(null, STDIN_FILENO) < 0
+				|| dup2(null, STDOUT_FILENO) < 0)
+			fatal("redo: failed to redirect to /dev/null");
+		if (null > STDOUT_FILENO)
+			close(null);
+
+		fn(arg);
+		exit(EXIT_SUCCESS);
+	}
+
+	int status;
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR)
+			fatal("redo: waitpid() failed");
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		/* the job never started */
+		if (maxjobs && write(js_write, "+", 1) != 1)
+			fatal("redo: failed to write to jobserver");
+		return false;
+	}
+
+	return true;
+}
+
+/* Take up to n additional job slots for threads of this process, without
+   waiting for any of them. Returns the number of slots taken, which are given
+   back by jobs_return(). */
+long jobs_borrow(long n) {
+	if (!maxjobs)
+		return n;
+	if (maxjobs == 1 || js_read < 0 || n <= 0)
+		return 0;
+
+	long got = 0;
+	while (got < n && try_token())
+		++got;
+
+	borrowed += got;
+	return got;
+}
+
+/* Give back all job slots taken by jobs_borrow(). */
+void jobs_return(void) {
+	for (; borrowed; --borrowed)
+		if (write(js_write, "+", 1) != 1)
+			fatal("redo: failed to write to jobserver");
+}
+
+/* Wait for all jobs started by us. Returns the number of failed jobs. */
+int jobs_wait(void) {
+	while (running)
+		reap(true);
+
+	int ret = failed;
+	failed = 0;
+	return ret;
+}
@@ -0,0 +1,25 @@
+/* jobs.h
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __RJOBS_H__
+#define __RJOBS_H__
+
+#include <stdbool.h>
+
+typedef void (*job_fn)(void *arg);
+
+extern void jobs_init(long maxjobs);
+extern bool jobs_attach(void);
+extern bool jobs_parallel(void);
+extern void job_start(job_fn fn, void *arg);
+extern bool job_detach(job_fn fn, void *arg);
+extern int jobs_wait(void);
+extern long jobs_borrow(long n);
+extern void jobs_return(void);
+
+#endif
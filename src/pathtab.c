@@ -0,0 +1,219 @@
+/* pathtab.c
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libgen.h> /* dirname() */
+
+#include "pathtab.h"
+#include "util.h"
+#include "filepath.h"
+#define _FILENAME "pathtab.c"
+#include "dbg.h"
+
+/* Every path redo deals with is canonicalized, often several times per target,
+   which costs a realpath() and so one syscall per path component. Instead,
+   paths are interned here: each distinct string gets a stable id, and its
+   canonical form, its form relative to REDO_ROOT and the realpath of its
+   directory are only computed once. The canonical forms within the directory
+   of a .do script are forgotten by path_forget() once it ran, as it might have
+   changed the directory tree there. The table may be used by several threads
+   at once. */
+
+struct path_entry {
+	char *name;
+	uint64_t hash;
+	unsigned dir;   /* id + 1 of the directory of name, 0 if not known yet */
+	char *real;     /* canonical form of name, see path_real() */
+	char *dir_real; /* realpath() of name, if it's used as a directory */
+	bool made;      /* see path_made() */
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct path_entry *entries;
+	size_t count, size;
+	unsigned *slots; /* id + 1, open addressing on the hash of the name */
+	size_t nslots;   /* always a power of 2 */
+} tab = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t fnv1a(const char *s) {
+	uint64_t h = 14695981039346656037ULL;
+	while (*s)
+		h = (h ^ (unsigned char) *s++) * 1099511628211ULL;
+
+	return h;
+}
+
+static void grow_slots(void) {
+	free(tab.slots);
+	tab.nslots = tab.nslots ? tab.nslots * 2 : 1024;
+	tab.slots = xmalloc(tab.nslots * sizeof(*tab.slots));
+	memset(tab.slots, 0, tab.nslots * sizeof(*tab.slots));
+
+	for (size_t id = 0; id < tab.count; ++id) {
+		size_t i = tab.entries[id].hash & (tab.nslots - 1);
+		while (tab.slots[i])
+			i = (i + 1) & (tab.nslots - 1);
+		tab.slots[i] = id + 1;
+	}
+}
+
+/* Must be called with the lock held. */
+static unsigned intern(const char *path) {
+	uint64_t hash = fnv1a(path);
+
+	if (tab.nslots) {
+		for (size_t i = hash & (tab.nslots - 1); tab.slots[i];
+				i = (i + 1) & (tab.nslots - 1)) {
+			struct path_entry *e = &tab.entries[tab.slots[i] - 1];
+			if (e->hash == hash && !strcmp(e->name, path))
+				return tab.slots[i] - 1;
+		}
+	}
+
+	if (tab.count == tab.size) {
+		tab.size = tab.size ? tab.size * 2 : 256;
+		tab.entries = tab.entries
+			? xrealloc(tab.entries, tab.size * sizeof(*tab.entries))
+			: xmalloc(tab.size * sizeof(*tab.entries));
+	}
+
+	unsigned id = tab.count++;
+	tab.entries[id] = (struct path_entry) {
+		.name = xstrdup(path),
+		.hash = hash,
+	};
+
+	if (tab.count * 2 > tab.nslots) {
+		grow_slots();
+	} else {
+		size_t i = hash & (tab.nslots - 1);
+		while (tab.slots[i])
+			i = (i + 1) & (tab.nslots - 1);
+		tab.slots[i] = id + 1;
+	}
+
+	return id;
+}
+
+/* Returns the id of path, which stays the same for the lifetime of the
+   process. */
+unsigned path_intern(const char *path) {
+	pthread_mutex_lock(&tab.lock);
+	unsigned id = intern(path);
+	pthread_mutex_unlock(&tab.lock);
+	return id;
+}
+
+/* Returns the canonical form of the path of id, like realpath() except that
+   the last component doesn't have to exist. Returns NULL if its directory
+   doesn't exist. The lock is released while realpath() walks the directory,
+   so that other threads don't have to wait for it. */
+const char *path_real(unsigned id) {
+	pthread_mutex_lock(&tab.lock);
+	struct path_entry *e = &tab.entries[id];
+	const char *result = e->real;
+	if (result) {
+		pthread_mutex_unlock(&tab.lock);
+		return result;
+	}
+
+	if (!e->dir) {
+		char *dirc = xstrdup(e->name);
+		unsigned dir = intern(dirname(dirc));
+		free(dirc);
+
+		e = &tab.entries[id];
+		e->dir = dir + 1;
+	}
+
+	unsigned dir = e->dir - 1;
+	if (!tab.entries[dir].dir_real) {
+		/* names never move, unlike the entries */
+		const char *name = tab.entries[dir].name;
+		pthread_mutex_unlock(&tab.lock);
+		char *resolved = realpath(name, NULL);
+		pthread_mutex_lock(&tab.lock);
+
+		/* failures aren't remembered, the directory might be created later */
+		if (!resolved) {
+			pthread_mutex_unlock(&tab.lock);
+			return NULL;
+		}
+
+		/* another thread might have been quicker */
+		if (tab.entries[dir].dir_real)
+			free(resolved);
+		else
+			tab.entries[dir].dir_real = resolved;
+	}
+
+	e = &tab.entries[id];
+	if (!e->real)
+		e->real = concat(3, tab.entries[dir].dir_real, "/",
+				xbasename(e->name));
+
+	result = e->real;
+	pthread_mutex_unlock(&tab.lock);
+	return result;
+}
+
+/* Returns the path of id relative to REDO_ROOT, or its canonical form if it's
+   outside of REDO_ROOT. Returns NULL if its directory doesn't exist. */
+const char *path_rel(unsigned id) {
+	const char *result = path_real(id);
+	return result ? relpath((char *) result, getenv("REDO_ROOT")) : NULL;
+}
+
+/* Returns true if path_set_made() was called for id. Callers use this to
+   remember that they created the directory of a path. */
+bool path_made(unsigned id) {
+	pthread_mutex_lock(&tab.lock);
+	bool made = tab.entries[id].made;
+	pthread_mutex_unlock(&tab.lock);
+	return made;
+}
+
+void path_set_made(unsigned id) {
+	pthread_mutex_lock(&tab.lock);
+	tab.entries[id].made = true;
+	pthread_mutex_unlock(&tab.lock);
+}
+
+/* Returns true if the canonical path is dir or lies below it. */
+static bool within(const char *path, const char *dir, size_t len) {
+	return path && !strncmp(path, dir, len)
+		&& (path[len] == '/' || path[len] == '\0');
+}
+
+/* Forget the canonical forms of the paths within the canonical directory dir,
+   as directories there might have been removed or replaced since. Strings
+   returned for them by path_real() and path_rel() become invalid. Must not be
+   called while other threads use the table. */
+void path_forget(const char *dir) {
+	size_t len = strcmp(dir, "/") ? strlen(dir) : 0;
+
+	for (size_t id = 0; id < tab.count; ++id) {
+		struct path_entry *e = &tab.entries[id];
+		if (within(e->real, dir, len)) {
+			free(e->real);
+			e->real = NULL;
+		}
+		if (within(e->dir_real, dir, len)) {
+			free(e->dir_real);
+			e->dir_real = NULL;
+		}
+	}
+}
@@ -0,0 +1,21 @@
+/* pathtab.h
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __RPATHTAB_H__
+#define __RPATHTAB_H__
+
+#include <stdbool.h>
+
+extern unsigned path_intern(const char *path);
+extern const char *path_real(unsigned id);
+extern const char *path_rel(unsigned id);
+extern bool path_made(unsigned id);
+extern void path_set_made(unsigned id);
+extern void path_forget(const char *dir);
+
+#endif
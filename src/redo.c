@@ -6,9 +6,10 @@
  * of the MIT license.  See the LICENSE file for details.
  */
 
-#define _XOPEN_SOURCE 600
+#define _XOPEN_SOURCE 700
 #include <stdio.h>
 #include <stdlib.h>
+#include <assert.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
@@ -16,6 +17,10 @@
 #include <unistd.h>
 
 #include "build.h"
+#include "depdb.h"
+#include "depfile.h"
+#include "hash.h"
+#include "jobs.h"
 #include "util.h"
 #include "dbg.h"
 #include "filepath.h"
@@ -26,10 +31,25 @@ static inline unsigned digits(unsigned n) {
 	return n ? 1 + digits(n/10) : n;
 }
 
-void prepare_env() {
+/* Returns the number of jobs to run in parallel if nothing was specified. */
+static long default_jobs(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+/* Set up the jobserver, which is shared with all our children, and the
+   environment variables needed by nested invocations. Jobs is the number of
+   jobs requested on the command line, or -1 if there was no such request.
+   Returns false if we were invoked by a .do script of another redo. */
+bool prepare_env(long jobs) {
+	if (jobs >= 0)
+		jobs_init(jobs);
+	else if (!jobs_attach())
+		jobs_init(default_jobs());
+
 	if (getenv("REDO_ROOT") && getenv("REDO_PARENT_TARGET")
 	    && getenv("REDO_MAGIC"))
-		return;
+		return false;
 
 	/* set REDO_ROOT */
 	char *cwd = getcwd(NULL, 0);
@@ -37,13 +57,230 @@ void prepare_env() {
 		fatal("redo: failed to obtain cwd");
 	if (setenv("REDO_ROOT", cwd, 0))
 		fatal("redo: failed to setenv() REDO_ROOT to %s", cwd);
+
+	/* clean up the database, unless another redo is using it */
+	if (depdb_open(cwd))
+		depdb_compact();
 	free(cwd);
 
-	/* set REDO_MAGIC */
+	/* set REDO_MAGIC, which must differ between runs as it is used to stamp
+	   the dependency records that were checked during this run */
+	struct timespec ts;
+	if (clock_gettime(CLOCK_REALTIME, &ts))
+		fatal("redo: failed to get the current time");
+
+	unsigned magic = ((unsigned) ts.tv_sec * 1000003u) ^ (unsigned) ts.tv_nsec
+			^ ((unsigned) getpid() << 12);
+
 	char magic_str[digits(UINT_MAX) + 1];
-	sprintf(magic_str, "%u", rand());
+	sprintf(magic_str, "%u", magic & INT_MAX);
 	if (setenv("REDO_MAGIC", magic_str, 0))
 		fatal("redo: failed to setenv() REDO_MAGIC to %s", magic_str);
+
+	return true;
+}
+
+/* Parse the options given to redo and remove them from argv. Returns the
+   number of jobs requested, 0 for no limit or -1 if -j wasn't given. */
+static long parse_options(int *argc, char *argv[], bool *db) {
+	long jobs = -1;
+	int i, j = 1;
+	char *arg, *end;
+
+	for (i = 1; i < *argc; ++i) {
+		arg = argv[i];
+		if (arg[0] != '-') {
+			argv[j++] = arg;
+			continue;
+		}
+
+		if (!strcmp(arg, "--")) {
+			++i;
+			break;
+		}
+
+		if (!strcmp(arg, "--db")) {
+			*db = true;
+			continue;
+		}
+
+		if (!strcmp(arg, "--git-index")) {
+			if (setenv("REDO_GIT_INDEX", "1", 1))
+				fatal("redo: failed to setenv() REDO_GIT_INDEX to 1");
+			continue;
+		}
+
+		if (!strncmp(arg, "--hash=", 7)) {
+			if (hash_lookup(arg + 7) < 0)
+				die("redo: unknown hash algorithm %s\n", arg + 7);
+			if (setenv("REDO_HASH", arg + 7, 1))
+				fatal("redo: failed to setenv() REDO_HASH to %s", arg + 7);
+			continue;
+		}
+
+		if (!strncmp(arg, "-j", 2))
+			arg += 2;
+		else if (!strcmp(arg, "--jobs"))
+			arg += 6;
+		else if (!strncmp(arg, "--jobs=", 7))
+			arg += 7;
+		else
+			die("redo: unknown option %s\n", arg);
+
+		if (!*arg) {
+			jobs = 0;
+			continue;
+		}
+
+		jobs = strtol(arg, &end, 10);
+		if (*end || jobs < 1)
+			die("redo: invalid number of jobs: %s\n", arg);
+	}
+
+	while (i < *argc)
+		argv[j++] = argv[i++];
+
+	*argc = j;
+	argv[j] = NULL;
+	return jobs;
+}
+
+struct target_job {
+	const char *target;
+	int ident;
+};
+
+static void target_job(void *arg) {
+	struct target_job *job = arg;
+	update_target(job->target, job->ident);
+}
+
+/* Start updating target as a new job. The job either runs before job_start()
+   returns or in a child process with its own copy of the stack, so job may
+   live on the stack. */
+static void start_target(const char *target, int ident) {
+	struct target_job job = { target, ident };
+	job_start(target_job, &job);
+}
+
+/* Update count targets in parallel, as far as the job limit allows. Returns the
+   number of targets that failed. */
+static int update_targets(int count, char *targets[], int ident) {
+	assert(count > 0);
+
+	for (int i = 0; i < count; ++i)
+		start_target(targets[i], ident);
+
+	return jobs_wait();
+}
+
+/* Read targets separated by delim from stdin and start a job for each one as
+   soon as it has been read, so that building starts before the whole list is
+   known. Empty entries are skipped. Returns the targets read, and stores their
+   number in count. */
+static char **stream_targets(int delim, int ident, size_t *count) {
+	char **targets = NULL;
+	size_t alloc = 0;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	*count = 0;
+	while ((len = getdelim(&line, &size, delim, stdin)) >= 0) {
+		if (len && line[len-1] == delim)
+			line[--len] = '\0';
+		if (!len)
+			continue;
+
+		if (*count == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			targets = targets ? xrealloc(targets, alloc * sizeof(*targets))
+			                  : xmalloc(alloc * sizeof(*targets));
+		}
+
+		targets[*count] = xstrdup(line);
+		start_target(targets[*count], ident);
+		++*count;
+	}
+
+	if (ferror(stdin))
+		fatal("redo: failed to read targets from stdin");
+
+	free(line);
+	return targets;
+}
+
+/* Parse the options of redo-ifchange and redo-ifcreate and remove them from
+   argv. The targets named by depfiles given with --depfile are appended to
+   argv, which is reallocated if there are any. Returns the delimiter of the
+   targets to read from stdin, or -1 if they should not be read. */
+static int parse_applet_options(int *argc, char **argv[]) {
+	char **args = *argv;
+	char **targets = NULL;
+	size_t count = 0;
+	int delim = -1;
+	int i, j = 1;
+
+	for (i = 1; i < *argc; ++i) {
+		char *arg = args[i];
+		if (arg[0] != '-') {
+			args[j++] = arg;
+			continue;
+		}
+
+		if (!strcmp(arg, "--")) {
+			++i;
+			break;
+		}
+
+		if (!strcmp(arg, "--stdin")) {
+			if (delim < 0)
+				delim = '\n';
+			continue;
+		}
+
+		if (!strcmp(arg, "-0") || !strcmp(arg, "--null")) {
+			delim = '\0';
+			continue;
+		}
+
+		char *depfile;
+		if (!strncmp(arg, "--depfile=", 10))
+			depfile = arg + 10;
+		else if (!strcmp(arg, "--depfile") && i + 1 < *argc)
+			depfile = args[++i];
+		else if (!strcmp(arg, "--depfile"))
+			die("redo: option --depfile requires an argument\n");
+		else
+			die("redo: unknown option %s\n", arg);
+
+		size_t n;
+		char **names = depfile_read(depfile, &n);
+		if (!n)
+			continue;
+
+		targets = targets ? xrealloc(targets, (count + n) * sizeof(*targets))
+		                  : xmalloc(n * sizeof(*targets));
+		memcpy(targets + count, names, n * sizeof(*names));
+		count += n;
+		free(names);
+	}
+
+	while (i < *argc)
+		args[j++] = args[i++];
+
+	if (count) {
+		char **merged = xmalloc((j + count + 1) * sizeof(*merged));
+		memcpy(merged, args, j * sizeof(*merged));
+		memcpy(merged + j, targets, count * sizeof(*merged));
+		j += count;
+		args = *argv = merged;
+		free(targets);
+	}
+
+	*argc = j;
+	args[j] = NULL;
+	return delim;
 }
 
 int DBG_LVL;
@@ -53,16 +290,26 @@ int main(int argc, char *argv[]) {
 	char *argv_base = xbasename(argv[0]);
 
 	if (!strcmp(argv_base, "redo")) {
-		prepare_env();
-		if (argc < 2) {
+		bool db = false;
+		bool outermost = prepare_env(parse_options(&argc, argv, &db));
+
+		if (db)
+			depdb_create(getenv("REDO_ROOT"));
+
+		int failed = 0;
+		if (argc < 2)
 			update_target("all", 'a');
-		} else {
-			for (int i = 1; i < argc; ++i)
-				update_target(argv[i], 'a');
-		}
+		else
+			failed = update_targets(argc-1, &argv[1], 'a');
+
+		/* wait for the outputs that are still being hashed */
+		if (outermost)
+			settle_wait();
+
+		if (failed)
+			return EXIT_FAILURE;
 	} else {
 		char ident;
-		char **temp;
 		if      (!strcmp(argv_base, "redo-ifchange"))
 			ident = 'c';
 		else if (!strcmp(argv_base, "redo-ifcreate"))
@@ -80,23 +327,56 @@ int main(int argc, char *argv[]) {
 		if (!parent || !root || !magic)
 			die("%s must be called inside a .do script\n", argv[0]);
 
+		jobs_attach();
+
 		/* set DBG_LVL (for dbg.h) */
 		char *env = getenv("REDO_DEBUG");
 		if (env)
 			DBG_LVL = atoi(env);
 
-		if (ident == 'a')
+		int delim = -1;
+		if (ident != 'a')
+			delim = parse_applet_options(&argc, &argv);
+
+		if (ident == 'a') {
 			add_prereq(parent, parent, ident);
-		else
-			for (int i = 1; i < argc; ++i) {
-				do {
-					temp = &argv[rand() % (argc-1) + 1];
-				} while (!*temp);
-
-				update_target(*temp, ident);
-				add_prereq_path(*temp, xbasename(parent), ident);
-				*temp = NULL;
+		} else if (argc > 1 || delim >= 0) {
+			/* shuffle the targets, so that missing dependencies between them
+			   show up early */
+			for (int i = argc-1; i > 1; --i) {
+				int j = rand() % i + 1;
+				char *temp = argv[i];
+				argv[i] = argv[j];
+				argv[j] = temp;
+			}
+
+			for (int i = 1; i < argc; ++i)
+				start_target(argv[i], ident);
+
+			size_t count = 0;
+			char **streamed = NULL;
+			if (delim >= 0)
+				streamed = stream_targets(delim, ident, &count);
+
+			if (jobs_wait())
+				return EXIT_FAILURE;
+
+			/* record all of them at once */
+			if (count) {
+				streamed = xrealloc(streamed,
+						(argc-1 + count) * sizeof(*streamed));
+				memcpy(streamed + count, &argv[1],
+						(argc-1) * sizeof(*streamed));
+				count += argc-1;
+			} else {
+				streamed = &argv[1];
+				count = argc-1;
 			}
+
+			if (count)
+				add_prereqs_path(count, (const char **) streamed, parent,
+						ident);
+		}
 	}
 
 	return EXIT_SUCCESS;
@@ -22,6 +22,8 @@ typedef struct {
 void SHA1_Init(SHA_CTX* context);
 void SHA1_Update(SHA_CTX* context, const uint8_t* data, const size_t len);
 void SHA1_Final(uint8_t digest[SHA1_DIGEST_SIZE], SHA_CTX* context);
+const char *SHA1_Implementation(void);
+int SHA1_SelectImplementation(const char *name);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,375 @@
+/* statcache.c
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE /* syscall() */
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#endif
+
+#include "statcache.h"
+#include "util.h"
+#define _FILENAME "statcache.c"
+#include "dbg.h"
+
+/* Checking a target needs the metadata of each of its prereqs. On network
+   filesystems every stat() is a round trip to the server, so stat_prefetch()
+   requests the metadata of all prereqs at once: as a single batch of statx
+   operations through io_uring where available, otherwise spread over a few
+   threads. The results are kept for the lifetime of the process. */
+
+/* at most this many threads are used if io_uring isn't available */
+#define STAT_THREADS 8
+/* and each of them handles at least this many paths */
+#define STAT_PER_THREAD 8
+/* number of operations submitted to io_uring at once */
+#define RING_ENTRIES 64
+
+struct stat_slot {
+	char *path;
+	uint64_t hash;
+	bool valid;
+	int err;
+	struct stat st;
+};
+
+static struct {
+	struct stat_slot *slots;
+	size_t size; /* always a power of 2 */
+	size_t used;
+} cache;
+
+static uint64_t fnv1a(const char *s) {
+	uint64_t h = 14695981039346656037ULL;
+	while (*s)
+		h = (h ^ (unsigned char) *s++) * 1099511628211ULL;
+
+	return h;
+}
+
+/* Return the slot of path, or the empty slot where it belongs. */
+static struct stat_slot *find_slot(const char *path, uint64_t hash) {
+	for (size_t i = hash & (cache.size - 1);; i = (i + 1) & (cache.size - 1)) {
+		struct stat_slot *slot = &cache.slots[i];
+		if (!slot->path || (slot->hash == hash && !strcmp(slot->path, path)))
+			return slot;
+	}
+}
+
+/* Remember the result of stat()ing path, which is either err or st. */
+static void insert(const char *path, int err, const struct stat *st) {
+	if (2 * (cache.used + 1) > cache.size) {
+		struct stat_slot *old = cache.slots;
+		size_t old_size = cache.size;
+
+		cache.size = old_size ? 2 * old_size : 256;
+		cache.slots = xmalloc(cache.size * sizeof(*cache.slots));
+		memset(cache.slots, 0, cache.size * sizeof(*cache.slots));
+
+		for (size_t i = 0; i < old_size; ++i)
+			if (old[i].path)
+				*find_slot(old[i].path, old[i].hash) = old[i];
+
+		free(old);
+	}
+
+	uint64_t hash = fnv1a(path);
+	struct stat_slot *slot = find_slot(path, hash);
+	if (!slot->path) {
+		slot->path = xstrdup(path);
+		slot->hash = hash;
+		++cache.used;
+	}
+
+	slot->valid = true;
+	slot->err = err;
+	if (!err)
+		slot->st = *st;
+}
+
+/* Only the absence of a file is worth remembering, other errors might be
+   temporary. */
+static bool cacheable(int err) {
+	return !err || err == ENOENT || err == ENOTDIR;
+}
+
+/* Like stat(), but the result is taken from the cache if path was looked up
+   before. */
+int stat_cached(const char *path, struct stat *st) {
+	if (cache.size) {
+		struct stat_slot *slot = find_slot(path, fnv1a(path));
+		if (slot->path && slot->valid) {
+			if (slot->err) {
+				errno = slot->err;
+				return -1;
+			}
+
+			*st = slot->st;
+			return 0;
+		}
+	}
+
+	int err = stat(path, st) ? errno : 0;
+	if (cacheable(err))
+		insert(path, err, st);
+
+	errno = err;
+	return err ? -1 : 0;
+}
+
+/* Drop the cached metadata of path, e.g. because it was just rebuilt. */
+void stat_forget(const char *path) {
+	if (!cache.size)
+		return;
+
+	struct stat_slot *slot = find_slot(path, fnv1a(path));
+	if (slot->path)
+		slot->valid = false;
+}
+
+struct stat_batch {
+	const char **paths;
+	struct stat *st;
+	int *errs;
+	size_t count;
+	size_t next;
+};
+
+static void *stat_worker(void *arg) {
+	struct stat_batch *b = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count)
+		b->errs[i] = stat(b->paths[i], &b->st[i]) ? errno : 0;
+
+	return NULL;
+}
+
+/* stat() all paths of the batch with up to STAT_THREADS threads. */
+static void thread_stat(struct stat_batch *b) {
+	size_t n = (b->count + STAT_PER_THREAD - 1) / STAT_PER_THREAD;
+	if (n > STAT_THREADS)
+		n = STAT_THREADS;
+
+	pthread_t threads[STAT_THREADS];
+	size_t started = 0;
+	while (started + 1 < n
+			&& !pthread_create(&threads[started], NULL, stat_worker, b))
+		++started;
+
+	stat_worker(b);
+	for (size_t i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+}
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+static struct {
+	int fd; /* -1 if io_uring isn't available */
+	pid_t owner; /* a ring can't be shared with the processes we fork */
+	unsigned entries;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+} ring = { .fd = -2 };
+
+static bool ring_setup(void) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	ring.owner = getpid();
+	ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+	if (ring.fd < 0)
+		return false;
+
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single && cq_size > sq_size)
+		sq_size = cq_size;
+
+	char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd,
+			IORING_OFF_SQ_RING);
+	char *cq = single ? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, ring.fd, IORING_OFF_CQ_RING);
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd, IORING_OFF_SQES);
+
+	if (sq == MAP_FAILED || cq == MAP_FAILED || ring.sqes == MAP_FAILED) {
+		close(ring.fd);
+		ring.fd = -1;
+		return false;
+	}
+
+	ring.entries = p.sq_entries;
+	ring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *) (sq + p.sq_off.array);
+	ring.cq_head = (unsigned *) (cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	return true;
+}
+
+static void from_statx(struct stat *st, const struct statx *stx) {
+	memset(st, 0, sizeof(*st));
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	st->st_size = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/* Look up all paths of the batch with statx operations submitted through
+   io_uring, RING_ENTRIES at a time. Returns false if io_uring can't be used,
+   before anything was submitted. */
+static bool ring_stat(struct stat_batch *b) {
+	if (ring.fd >= 0 && ring.owner != getpid()) {
+		close(ring.fd);
+		ring.fd = -2;
+	}
+
+	if (ring.fd == -2 && !ring_setup())
+		return false;
+	if (ring.fd < 0)
+		return false;
+
+	struct statx *bufs = xmalloc(b->count * sizeof(*bufs));
+
+	for (size_t done = 0; done < b->count;) {
+		unsigned n = b->count - done < ring.entries ? b->count - done
+				: ring.entries;
+		unsigned tail = *ring.sq_tail;
+
+		for (unsigned i = 0; i < n; ++i) {
+			unsigned idx = (tail + i) & *ring.sq_mask;
+			struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uintptr_t) b->paths[done + i];
+			sqe->len = STATX_BASIC_STATS;
+			sqe->off = (uintptr_t) &bufs[done + i];
+			sqe->user_data = done + i;
+			ring.sq_array[idx] = idx;
+		}
+		__atomic_store_n(ring.sq_tail, tail + n, __ATOMIC_RELEASE);
+
+		unsigned submitted = 0, reaped = 0;
+		while (reaped < n) {
+			int r = syscall(__NR_io_uring_enter, ring.fd, n - submitted,
+					n - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+			if (r < 0) {
+				if (errno == EINTR)
+					continue;
+				if (done || submitted)
+					fatal("redo: io_uring_enter() failed");
+
+				/* e.g. forbidden by a seccomp filter */
+				__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+				close(ring.fd);
+				ring.fd = -1;
+				free(bufs);
+				return false;
+			}
+			submitted += r;
+
+			unsigned head = *ring.cq_head;
+			while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+				struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+				size_t i = cqe->user_data;
+
+				/* kernels without IORING_OP_STATX answer with EINVAL, and
+				   those paths are looked up again by stat_cached() */
+				b->errs[i] = cqe->res < 0 ? -cqe->res : 0;
+				if (!b->errs[i])
+					from_statx(&b->st[i], &bufs[i]);
+
+				++head;
+				++reaped;
+			}
+			__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+		}
+
+		done += n;
+	}
+
+	free(bufs);
+	return true;
+}
+#else
+static bool ring_stat(struct stat_batch *b) {
+	(void) b;
+	return false;
+}
+#endif
+
+/* Look up the metadata of all count paths which aren't cached yet at once, so
+   that later stat_cached() calls don't have to wait for them one by one. */
+void stat_prefetch(size_t count, const char *paths[]) {
+	if (count < 2)
+		return;
+
+	struct stat_batch b = {
+		.paths = xmalloc(count * sizeof(*b.paths)),
+	};
+
+	for (size_t i = 0; i < count; ++i) {
+		if (cache.size) {
+			struct stat_slot *slot = find_slot(paths[i], fnv1a(paths[i]));
+			if (slot->path && slot->valid)
+				continue;
+		}
+		b.paths[b.count++] = paths[i];
+	}
+
+	if (b.count > 1) {
+		b.st = xmalloc(b.count * sizeof(*b.st));
+		b.errs = xmalloc(b.count * sizeof(*b.errs));
+
+		if (!ring_stat(&b))
+			thread_stat(&b);
+
+		for (size_t i = 0; i < b.count; ++i)
+			if (cacheable(b.errs[i]))
+				insert(b.paths[i], b.errs[i], &b.st[i]);
+
+		free(b.st);
+		free(b.errs);
+	}
+
+	free(b.paths);
+}
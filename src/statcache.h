@@ -0,0 +1,19 @@
+/* statcache.h
+ *
+ * Copyright (c) 2017 Tharre
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __RSTATCACHE_H__
+#define __RSTATCACHE_H__
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+extern int stat_cached(const char *path, struct stat *st);
+extern void stat_forget(const char *path);
+extern void stat_prefetch(size_t count, const char *paths[]);
+
+#endif
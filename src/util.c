@@ -16,7 +16,6 @@
 #include <string.h>
 
 #include "util.h"
-#include "sha1.h"
 #define _FILENAME "util.c"
 #include "dbg.h"
 
@@ -58,11 +57,10 @@ char *xstrdup(const char *str) {
 	return (char*) str;
 }
 
-/* For concating multiple strings into a single larger one. */
-char *concat(size_t count, ...) {
+/* Concat count strings from ap into memory from a, or the heap if a is NULL. */
+static char *vconcat(arena *a, size_t count, va_list ap) {
 	assert(count > 0);
-	va_list ap, ap2;
-	va_start(ap, count);
+	va_list ap2;
 	va_copy(ap2, ap);
 	size_t i, size = 0, args_len[count];
 	for (i = 0; i < count; ++i) {
@@ -70,54 +68,95 @@ char *concat(size_t count, ...) {
 		size += args_len[i];
 	}
 	++size;
-	char *result = xmalloc(size);
+	char *result = arena_alloc(a, size);
 	/* debug("Allocated %zu bytes at %p\n", size, result); */
 	uintptr_t offset = 0;
 	for (i = 0; i < count; ++i) {
 		strcpy(&result[offset], va_arg(ap2, char*));
 		offset += args_len[i];
 	}
-	va_end(ap);
 	va_end(ap2);
 	return result;
 }
 
-/* Hash the target file, returning a pointer to the heap allocated hash. */
-unsigned char *hash_file(FILE *fp) {
-	unsigned char *hash = xmalloc(20);
+/* For concating multiple strings into a single larger one. */
+char *concat(size_t count, ...) {
+	va_list ap;
+	va_start(ap, count);
+	char *result = vconcat(NULL, count, ap);
+	va_end(ap);
+	return result;
+}
 
-	SHA_CTX context;
-	unsigned char data[8192];
-	size_t read;
+/* An arena hands out memory from large blocks by just bumping a pointer. It's
+   released all at once by going back to a copy of the arena taken earlier,
+   the mark, which suits memory that lives as long as a target is being
+   checked. The most recently released block is kept for reuse, so repeatedly
+   crossing a block boundary doesn't call malloc() each time. */
+
+#define ARENA_BLOCK (64 << 10)
+#define ARENA_ALIGN 16
+
+struct arena_block {
+	struct arena_block *prev;
+	size_t size;
+	/* keeps data aligned to ARENA_ALIGN on 64 bit platforms */
+	char data[];
+};
+
+/* Return size bytes from a, or from the heap if a is NULL. */
+void *arena_alloc(arena *a, size_t size) {
+	if (!a)
+		return xmalloc(size);
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	if (!a->block || a->block->size - a->used < size) {
+		struct arena_block *block;
+		if (size <= ARENA_BLOCK && a->spare) {
+			block = a->spare;
+			a->spare = NULL;
+		} else {
+			size_t block_size = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+			block = xmalloc(sizeof(*block) + block_size);
+			block->size = block_size;
+		}
+
+		block->prev = a->block;
+		a->block = block;
+		a->used = 0;
+	}
 
-	SHA1_Init(&context);
-	while ((read = fread(data, 1, sizeof data, fp)))
-		SHA1_Update(&context, data, read);
+	void *ptr = a->block->data + a->used;
+	a->used += size;
+	return ptr;
+}
 
-	if (ferror(fp))
-		fatal("redo: failed to read data");
-	SHA1_Final(hash, &context);
+char *arena_strdup(arena *a, const char *str) {
+	assert(str);
+	size_t len = strlen(str) + 1;
+	return memcpy(arena_alloc(a, len), str, len);
+}
 
-	return hash;
+/* Like concat(), with the result taken from a. */
+char *arena_concat(arena *a, size_t count, ...) {
+	va_list ap;
+	va_start(ap, count);
+	char *result = vconcat(a, count, ap);
+	va_end(ap);
+	return result;
 }
 
-/* Requires a buffer of at least 20*2+1 = 41 bytes */
-void sha1_to_hex(const unsigned char *sha1, char *buf) {
-	static const char hex[] = "0123456789abcdef";
+/* Release everything taken from a since mark was copied from it. */
+void arena_release(arena *a, const arena *mark) {
+	while (a->block != mark->block) {
+		struct arena_block *block = a->block;
+		a->block = block->prev;
 
-	for (int i = 0; i < 20; ++i) {
-		char *pos = buf + i*2;
-		*pos++ = hex[sha1[i] >> 4];
-		*pos = hex[sha1[i] & 0xf];
+		if (block->size == ARENA_BLOCK && !a->spare)
+			a->spare = block;
+		else
+			free(block);
 	}
 
-	buf[40] = '\0';
-}
-
-void hex_to_sha1(const char *s, unsigned char *sha1) {
-	static const char hex[] = "0123456789abcdef";
-
-	for (; *s; s += 2, ++sha1)
-		*sha1 = ((strchr(hex, *s) - hex) << 4) + strchr(hex, *(s+1)) - hex;
+	a->used = mark->used;
 }
-
@@ -17,8 +17,17 @@ extern void *xmalloc(size_t size);
 extern void *xrealloc(void *ptr, size_t size);
 extern char *xstrdup(const char *str);
 extern char *concat(size_t count, ...);
-extern unsigned char *hash_file(FILE *fp);
-extern void sha1_to_hex(const unsigned char *sha1, char *buf);
-extern void hex_to_sha1(const char *s, unsigned char *sha1);
+
+/* Memory taken from an arena is only released all at once, see util.c. */
+typedef struct arena {
+	struct arena_block *block;
+	size_t used;
+	struct arena_block *spare;
+} arena;
+
+extern void *arena_alloc(arena *a, size_t size);
+extern char *arena_strdup(arena *a, const char *str);
+extern char *arena_concat(arena *a, size_t count, ...);
+extern void arena_release(arena *a, const arena *mark);
 
 #endif
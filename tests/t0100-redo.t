@@ -54,4 +54,287 @@ test_expect_success "redo should succeed despite missing directories" "
     redo nonexistant
 "
 
+cat > "shared.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange shared.src
+echo "built" >> shared.log
+cat shared.src > $3
+EOF
+
+cat > "default.parent.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange shared
+echo "$2" >> parents.log
+cat shared > $3
+EOF
+
+cat > "parents.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange 1.parent 2.parent 3.parent
+EOF
+
+test_expect_success "shared dependencies are checked once per run" "
+    echo a > shared.src &&
+    redo parents &&
+    test \$(wc -l < shared.log) -eq 1 &&
+    test \$(wc -l < parents.log) -eq 3 &&
+    redo parents &&
+    test \$(wc -l < shared.log) -eq 1 &&
+    test \$(wc -l < parents.log) -eq 3
+"
+
+test_expect_success "a changed shared dependency rebuilds every parent" "
+    echo b > shared.src &&
+    redo parents &&
+    test \$(wc -l < shared.log) -eq 2 &&
+    test \$(wc -l < parents.log) -eq 6
+"
+
+cat > "colon.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange "some:source"
+cat "some:source" > $3
+EOF
+
+cat > "colon-parent.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange colon
+cat colon > $3
+EOF
+
+test_expect_success "prerequisites containing colons are tracked" "
+    echo a > some:source &&
+    redo colon-parent &&
+    echo b > some:source &&
+    redo colon-parent &&
+    test \$(cat colon-parent) = b
+"
+
+cat > "many.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange m1.src m2.src m3.src
+cat m1.src m2.src m3.src > $3
+EOF
+
+test_expect_success "prerequisites of one call are all recorded" "
+    for i in 1 2 3; do echo \$i > m\$i.src; done &&
+    redo many &&
+    test \$(grep -c '^c:m[123]\.src\$' .redo/rel/many.prereq) -eq 3
+"
+
+cat > "cutoff.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange cutoff.src
+echo "built" >> cutoff.log
+cut -c1 cutoff.src > $3
+EOF
+
+cat > "cutoff-parent.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange cutoff
+echo "built" >> cutoff-parent.log
+cat cutoff > $3
+EOF
+
+cat > "cutoff-top.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange cutoff-parent
+EOF
+
+test_expect_success "outputs are hashed by the end of the run" "
+    echo a1 > cutoff.src &&
+    redo cutoff-top &&
+    grep -q '^[0-9a-f]\{40\}:.*:lc\$' .redo/rel/cutoff
+"
+
+test_expect_success "an unchanged output doesn't rebuild its parents" "
+    echo a2 > cutoff.src &&
+    redo cutoff-top &&
+    test \$(wc -l < cutoff.log) -eq 2 &&
+    test \$(wc -l < cutoff-parent.log) -eq 1
+"
+
+cat > "wide.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange $(seq -f w%g.src 1 300)
+echo "built" >> wide.log
+cat w*.src > $3
+EOF
+
+cat > "wide-top.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange wide
+EOF
+
+test_expect_success "a change among many prerequisites is found" "
+    for i in \$(seq 1 300); do echo \$i > w\$i.src; done &&
+    redo wide-top &&
+    redo wide-top &&
+    test \$(wc -l < wide.log) -eq 1 &&
+    echo x > w250.src &&
+    redo wide-top &&
+    test \$(wc -l < wide.log) -eq 2
+"
+
+cat > "default.chain.do" <<'EOF'
+#!/bin/sh -e
+if [ "$2" -gt 0 ]; then
+    redo-ifchange $(($2 - 1)).chain
+    cat $(($2 - 1)).chain > $3
+else
+    redo-ifchange chain.src
+    cat chain.src > $3
+fi
+EOF
+
+cat > "chain-top.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange 60.chain
+EOF
+
+test_expect_success "a change at the end of a long chain is found" "
+    echo a > chain.src &&
+    redo chain-top &&
+    redo chain-top &&
+    echo b > chain.src &&
+    redo chain-top &&
+    test \$(cat 60.chain) = b
+"
+
+cat > "default.gen.do" <<'EOF'
+#!/bin/sh -e
+echo "$1 $2" > $3
+EOF
+
+cat > "gen-top.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange sub/deeper/x.gen
+EOF
+
+test_expect_success "default.do scripts are found in parent directories" "
+    mkdir -p sub/deeper &&
+    redo gen-top &&
+    test \"\$(cat sub/deeper/x.gen)\" = 'sub/deeper/x.gen sub/deeper/x'
+"
+
+test_expect_success "a closer default.do script takes over" "
+    echo 'echo \"\$1\" > \$3' > sub/default.gen.do &&
+    redo gen-top &&
+    test \"\$(cat sub/deeper/x.gen)\" = deeper/x.gen
+"
+
+mkdir made
+
+cat > "made/first.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange second.do
+echo first > $3
+EOF
+
+cat > "made/second.do.do" <<'EOF'
+#!/bin/sh -e
+echo 'echo second > $3' > $3
+EOF
+
+test_expect_success ".do scripts built by another redo process are found" "
+    (cd made && redo first second) &&
+    test \$(cat made/second) = second
+"
+
+cat > "default.dep.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange "$2.src"
+cat "$2.src" > $3
+EOF
+
+cat > "dep-top.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange sub/deeper/y.dep
+EOF
+
+test_expect_success "prerequisites are recorded for the target of a parent default.do" "
+    echo a > sub/deeper/y.src &&
+    redo dep-top &&
+    echo b > sub/deeper/y.src &&
+    redo dep-top &&
+    test \$(cat sub/deeper/y.dep) = b
+"
+
+cat > "headers.do" <<'EOF'
+#!/bin/sh -e
+printf 'headers.o: h1.h \\\n  h\\ 2.h\nh1.h:\n' > "$3.d"
+redo-ifchange --depfile "$3.d"
+rm "$3.d"
+cat h1.h "h 2.h" > $3
+EOF
+
+cat > "headers-top.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange headers
+EOF
+
+test_expect_success "prerequisites are read from depfiles" "
+    echo a > h1.h &&
+    echo b > 'h 2.h' &&
+    redo headers-top &&
+    grep -q '^c:h1.h\$' .redo/rel/headers.prereq &&
+    echo c > 'h 2.h' &&
+    redo headers-top &&
+    test \"\$(tail -n1 headers)\" = c
+"
+
+cat > "nodepfile.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange --depfile
+EOF
+
+test_expect_success "a --depfile without a file is reported" "
+    test_must_fail redo nodepfile 2> nodepfile.err &&
+    grep -q 'requires an argument' nodepfile.err
+"
+
+cat > "listed.do" <<'EOF'
+#!/bin/sh -e
+seq -f l%g.src 1 200 | redo-ifchange --stdin
+printf 'l 1.src\0l 2.src\0' | redo-ifchange -0
+cat l*.src > $3
+EOF
+
+cat > "listed-top.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange listed
+EOF
+
+test_expect_success "targets are read from stdin" "
+    for i in \$(seq 1 200); do echo \$i > l\$i.src; done &&
+    echo a > 'l 1.src' && echo b > 'l 2.src' &&
+    redo listed-top &&
+    test \$(grep -c '^c:l[0-9]*\.src\$' .redo/rel/listed.prereq) -eq 200 &&
+    echo x > l150.src &&
+    redo listed-top &&
+    grep -q x listed &&
+    echo y > 'l 2.src' &&
+    redo listed-top &&
+    grep -q y listed
+"
+
+cat > "always.do" <<'EOF'
+#!/bin/sh -e
+redo-always
+echo run >> always.log
+echo always > $3
+EOF
+
+cat > "always-top.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange always
+EOF
+
+test_expect_success "redo-always targets are rebuilt on every run" "
+    redo always-top &&
+    redo always-top &&
+    redo always-top &&
+    test \$(wc -l < always.log) -eq 3
+"
+
 test_done
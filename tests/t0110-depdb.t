@@ -0,0 +1,116 @@
+#!/bin/sh -e
+# Copyright (c) 2017 Tharre
+#
+# This software may be modified and distributed under the terms
+# of the MIT license.  See the LICENSE file for details.
+
+test_description='Dependency database'
+
+. ./sharness.sh
+
+cat > "default.out.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange "$2.in"
+echo "$2" >> build.log
+cat "$2.in" > $3
+EOF
+
+cat > "all.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange a.out b.out
+EOF
+
+test_expect_success "--db migrates existing records" "
+    echo a > a.in &&
+    echo b > b.in &&
+    redo &&
+    test -e .redo/rel/a.out &&
+    redo --db &&
+    test -e .redo/deps.db &&
+    test_must_fail test -e .redo/rel &&
+    test \$(wc -l < build.log) -eq 2
+"
+
+test_expect_success "changes are detected" "
+    echo c > a.in &&
+    redo &&
+    test \$(wc -l < build.log) -eq 3 &&
+    test \$(cat a.out) = c
+"
+
+test_expect_success "parallel builds share the database" "
+    echo d > a.in &&
+    echo d > b.in &&
+    redo -j2 &&
+    test \$(wc -l < build.log) -eq 5 &&
+    redo -j2 &&
+    test \$(wc -l < build.log) -eq 5
+"
+
+test_expect_success "partially written entries are ignored" "
+    printf 'garbage' >> .redo/deps.db &&
+    echo e > b.in &&
+    redo &&
+    test \$(wc -l < build.log) -eq 6 &&
+    redo &&
+    test \$(wc -l < build.log) -eq 6
+"
+
+test_expect_success "a lost index is rebuilt" "
+    rm .redo/deps.idx &&
+    redo &&
+    test \$(wc -l < build.log) -eq 6 &&
+    echo f > a.in &&
+    redo &&
+    test \$(wc -l < build.log) -eq 7
+"
+
+# the index header takes up 64 bytes, the last 8 of which mark it as dirty
+test_expect_success "an index left behind by an interrupted update is rebuilt" "
+    size=\$(wc -c < .redo/deps.idx) &&
+    dd if=/dev/zero of=.redo/deps.idx bs=64 seek=1 \\
+        count=\$((size / 64 - 1)) conv=notrunc 2> /dev/null &&
+    printf '\\001' | dd of=.redo/deps.idx bs=1 seek=56 conv=notrunc 2> /dev/null &&
+    redo &&
+    test \$(wc -l < build.log) -eq 7 &&
+    echo g > b.in &&
+    redo &&
+    test \$(wc -l < build.log) -eq 8 &&
+    test \$(cat b.out) = g
+"
+
+test_expect_success "a truncated index is rebuilt" "
+    head -c 4096 .redo/deps.idx > idx &&
+    cat idx > .redo/deps.idx &&
+    redo &&
+    test \$(wc -l < build.log) -eq 8 &&
+    echo h > a.in &&
+    redo &&
+    test \$(wc -l < build.log) -eq 9 &&
+    test \$(cat a.out) = h
+"
+
+cat > "slow.do" <<'EOF'
+#!/bin/sh -e
+touch slow.started
+while [ ! -e slow.go ]; do sleep 0.1; done
+echo slow > $3
+EOF
+
+test_expect_success "the database isn't compacted while another redo uses it" "
+    (redo slow > /dev/null 2>&1 &) &&
+    while [ ! -e slow.started ]; do sleep 0.1; done &&
+    inode=\$(ls -i .redo/deps.db) &&
+    for i in \$(seq 1 200); do redo a.out > /dev/null 2>&1; done &&
+    test \"\$(ls -i .redo/deps.db)\" = \"\$inode\" &&
+    touch slow.go &&
+    while [ ! -e slow ]; do sleep 0.1; done &&
+    sleep 0.5 &&
+    redo &&
+    test \"\$(ls -i .redo/deps.db)\" != \"\$inode\" &&
+    test \$(wc -l < build.log) -eq 209 &&
+    redo &&
+    test \$(wc -l < build.log) -eq 209
+"
+
+test_done
@@ -0,0 +1,131 @@
+#!/bin/sh -e
+# Copyright (c) 2017 Tharre
+#
+# This software may be modified and distributed under the terms
+# of the MIT license.  See the LICENSE file for details.
+
+test_description='Hash algorithms'
+
+. ./sharness.sh
+
+cat > "default.out.do" <<'EOT'
+#!/bin/sh -e
+redo-ifchange "$2.in"
+echo "$2" >> build.log
+cat "$2.in" > $3
+EOT
+
+cat > "all.do" <<'EOT'
+#!/bin/sh -e
+redo-ifchange a.out
+EOT
+
+test_expect_success "records use SHA-1 by default" "
+    printf x > a.in &&
+    redo &&
+    grep -q '^[0-9a-f]\{40\}:' .redo/rel/a.in &&
+    grep -q '^[0-9a-f]\{40\}:' .redo/rel/a.out
+"
+
+test_expect_success "switching algorithms doesn't rebuild anything" "
+    touch a.in &&
+    redo --hash=blake3 &&
+    test \$(wc -l < build.log) -eq 1
+"
+
+# BLAKE3 of "abc"
+abc=6437b3ac38465133ffb63b75273a8db548c558465d79db03fd359c6cd5bd9d85
+
+test_expect_success "changed files are hashed with the new algorithm" "
+    printf abc > a.in &&
+    redo --hash=blake3 &&
+    test \$(wc -l < build.log) -eq 2 &&
+    grep -q \"^blake3-\$abc:\" .redo/rel/a.in &&
+    grep -q '^blake3-[0-9a-f]\{64\}:' .redo/rel/a.out
+"
+
+test_expect_success "records of other algorithms are still checked" "
+    touch a.in &&
+    redo &&
+    test \$(wc -l < build.log) -eq 2 &&
+    printf abcd > a.in &&
+    redo &&
+    test \$(wc -l < build.log) -eq 3
+"
+
+test_expect_success "unknown algorithms are rejected" "
+    test_must_fail redo --hash=md5
+"
+
+cat > "linked.do" <<'EOT'
+#!/bin/sh -e
+redo-ifchange shared.in linked.in
+cat shared.in linked.in > $3
+EOT
+
+test_expect_success "files are hashed once no matter how many names they have" "
+    seq 1 20000 > shared.in &&
+    ln shared.in linked.in &&
+    sleep 2 &&
+    redo linked &&
+    test \$(cat .redo/hash/* | wc -l) -eq 1
+"
+
+cat > "st.do" <<'EOT'
+#!/bin/sh -e
+redo-ifchange st.out
+EOT
+
+test_expect_success "stat fingerprints don't look at the contents" "
+    echo a > st.in &&
+    redo --hash=stat st &&
+    grep -q '^stat-[0-9a-f]\{56\}:' .redo/rel/st.in &&
+    touch -r st.in st.ref &&
+    echo b > st.in &&
+    touch -r st.ref st.in &&
+    redo --hash=stat st &&
+    test \$(grep -c '^st\$' build.log) -eq 1
+"
+
+test_expect_success "stat fingerprints are invalid once hashing again" "
+    redo st &&
+    test \$(grep -c '^st\$' build.log) -eq 2 &&
+    test \$(cat st.out) = b
+"
+
+command -v git > /dev/null && test_set_prereq GIT
+
+cat > "tracked.do" <<'EOT'
+#!/bin/sh -e
+redo-ifchange tracked.out
+EOT
+
+test_expect_success GIT "sources are recorded by their git blob id" "
+    git init -q . &&
+    seq 1 20000 > tracked.in &&
+    git add tracked.in &&
+    redo --git-index tracked &&
+    grep -q \"^gitblob-\$(git hash-object tracked.in):\" .redo/rel/tracked.in
+"
+
+test_expect_success GIT "unchanged files are validated with the git index" "
+    rm tracked.in &&
+    git checkout tracked.in &&
+    sleep 2 &&
+    git rm -q --cached tracked.in &&
+    git add tracked.in &&
+    cached=\$(ls .redo/hash | wc -l) &&
+    redo --git-index tracked &&
+    test \$(ls .redo/hash | wc -l) -eq \$cached &&
+    test \$(grep -c tracked build.log) -eq 1
+"
+
+command -v sha1sum > /dev/null && test_set_prereq SHA1SUM
+
+test_expect_success SHA1SUM "SHA-1 digests are correct" "
+    seq 1 100000 > big.in &&
+    redo big.out &&
+    grep -q \"^\$(sha1sum < big.in | cut -c1-40):\" .redo/rel/big.in
+"
+
+test_done
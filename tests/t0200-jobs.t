@@ -0,0 +1,153 @@
+#!/bin/sh -e
+# Copyright (c) 2017 Tharre
+#
+# This software may be modified and distributed under the terms
+# of the MIT license.  See the LICENSE file for details.
+
+test_description='Parallel builds'
+
+. ./sharness.sh
+
+# both targets wait for each other, so they can only succeed if they run at the
+# same time
+cat > "default.meet.do" <<'EOF'
+#!/bin/sh -e
+touch "$2.started"
+other=$(cat "$2.other")
+i=0
+while [ ! -e "$other.started" ]; do
+	i=$((i+1))
+	[ $i -lt 50 ] || exit 1
+	sleep 0.1
+done
+echo "$1" > $3
+EOF
+
+cat > "default.slot.do" <<'EOF'
+#!/bin/sh -e
+touch "running.$2"
+ls running.* | wc -l >> concurrency
+sleep 0.2
+rm "running.$2"
+echo "$1" > $3
+EOF
+
+cat > "shared.do" <<'EOF'
+#!/bin/sh -e
+echo built >> shared.count
+echo shared > $3
+EOF
+
+cat > "default.user.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange shared
+cat shared > $3
+EOF
+
+test_expect_success "-j2 runs targets in parallel" "
+    echo b > a.other &&
+    echo a > b.other &&
+    redo -j2 a.meet b.meet
+"
+
+test_expect_success "-j1 runs targets one after another" "
+    rm -f a.meet b.meet a.started b.started &&
+    test_must_fail redo -j1 a.meet b.meet
+"
+
+cat > "pair.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange c.meet d.meet
+cat c.meet d.meet > $3
+EOF
+
+test_expect_success "redo-ifchange builds its targets in parallel" "
+    echo d > c.other &&
+    echo c > d.other &&
+    redo -j2 pair &&
+    test \$(cat pair | wc -l) -eq 2
+"
+
+test_expect_success "job limit is honored" "
+    redo --jobs=2 1.slot 2.slot 3.slot 4.slot &&
+    test \$(sort -n concurrency | tail -n 1) -le 2
+"
+
+test_expect_success "shared dependencies are built only once" "
+    redo -j a.user b.user c.user &&
+    test \$(wc -l < shared.count) -eq 1
+"
+
+cat > "default.out.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange $2.in
+cut -c1 $2.in > $3
+EOF
+
+cat > "default.use.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange $2.out
+echo built >> use.log
+cat $2.out > $3
+EOF
+
+cat > "uses.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange 1.use 2.use 3.use
+EOF
+
+test_expect_success "outputs hashed in free job slots are done by the end of the run" "
+    for i in 1 2 3; do echo a1 > \$i.in; done &&
+    redo -j8 uses &&
+    ! grep -q 'p\$' .redo/rel/*.out .redo/rel/*.use &&
+    for i in 1 2 3; do echo a2 > \$i.in; done &&
+    redo -j8 uses &&
+    test \$(wc -l < use.log) -eq 3
+"
+
+cat > "ticker.do" <<'EOF'
+#!/bin/sh -e
+redo-always
+echo built >> ticker.log
+sleep 0.5
+date > $3
+EOF
+
+cat > "default.tick.do" <<'EOF'
+#!/bin/sh -e
+redo-ifchange ticker
+cat ticker > $3
+EOF
+
+test_expect_success "redo-always targets shared by several jobs run only once" "
+    redo -j4 a.tick b.tick c.tick &&
+    rm ticker.log &&
+    redo -j4 a.tick b.tick c.tick &&
+    test \$(wc -l < ticker.log) -eq 1
+"
+
+cat > "Makefile" <<'EOF'
+all: 1.mk 2.mk 3.mk 4.mk
+%.mk:
+	@touch running.$@; ls running.* | wc -l >> make.concurrency
+	@sleep 0.2; rm running.$@; touch $@
+EOF
+
+cat > "submake.do" <<'EOF'
+#!/bin/sh -e
+make -s all
+EOF
+
+command -v make > /dev/null && test_set_prereq MAKE
+
+test_expect_success MAKE "sub-makes share the jobserver" "
+    redo -j2 submake &&
+    test \$(sort -n make.concurrency | tail -n 1) -eq 2
+"
+
+test_expect_success "invalid job count is rejected" "
+    test_must_fail redo -j0 a.user &&
+    test_must_fail redo --jobs=x a.user
+"
+
+test_done